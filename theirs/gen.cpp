@@ -0,0 +1,487 @@
+#include "llvm/Support/CommandLine.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Random Kaleidoscope program generator
+//===----------------------------------------------------------------------===//
+
+// Writes a valid program to stdout for benchmarking and stress testing the
+// toy driver: user-defined operators first, then the definitions, then
+// top-level expressions that call them.  Definitions only call definitions
+// that come before them, so there is no recursion, and every definition has a
+// budget of estimated operations (-max-cost) that bounds its loops and calls.
+// Every generated program therefore terminates, in roughly predictable time.
+//
+// The same seed and options always produce the same program.
+
+static cl::opt<unsigned>
+Seed("seed", cl::init(1), cl::desc("Random seed"));
+
+static cl::opt<unsigned>
+NumDefs("defs", cl::init(50), cl::desc("Number of function definitions"));
+
+static cl::opt<unsigned>
+NumExprs("exprs", cl::init(20), cl::desc("Number of top-level expressions"));
+
+static cl::opt<unsigned>
+MaxParams("max-params", cl::init(4),
+          cl::desc("Most parameters a definition takes"));
+
+static cl::opt<unsigned>
+MeanSize("mean-size", cl::init(30),
+         cl::desc("Mean number of AST nodes in a definition's body"));
+
+enum SizeDistribution { size_fixed, size_uniform, size_geometric, size_pareto };
+
+static cl::opt<SizeDistribution>
+SizeDist("size-dist", cl::init(size_geometric),
+         cl::desc("Distribution of definition body sizes"),
+         cl::values(clEnumValN(size_fixed, "fixed", "every body is -mean-size"),
+                    clEnumValN(size_uniform, "uniform",
+                               "uniform up to twice -mean-size"),
+                    clEnumValN(size_geometric, "geometric",
+                               "many small bodies, a few large ones"),
+                    clEnumValN(size_pareto, "pareto",
+                               "heavy tailed: occasional huge bodies"),
+                    clEnumValEnd));
+
+static cl::opt<unsigned>
+MaxDepth("max-depth", cl::init(8), cl::desc("Deepest expression nesting"));
+
+static cl::opt<std::string>
+OpMix("op-mix", cl::init("+:4,-:2,*:3,<:2,user:1"),
+      cl::desc("Relative weights of the binary operators, as op:weight "
+               "pairs; 'user' is shared by the user-defined operators"));
+
+static cl::opt<double>
+CallWeight("call-weight", cl::init(2),
+           cl::desc("Weight of calls against the binary operator mix"));
+
+static cl::opt<double>
+IfWeight("if-weight", cl::init(1), cl::desc("Weight of if/then/else"));
+
+static cl::opt<double>
+LoopWeight("loop-weight", cl::init(0.5), cl::desc("Weight of for loops"));
+
+static cl::opt<double>
+VarWeight("var-weight", cl::init(0.5), cl::desc("Weight of var/in"));
+
+static cl::opt<double>
+UnaryWeight("unary-weight", cl::init(0.5),
+            cl::desc("Weight of user-defined unary operators"));
+
+static cl::opt<unsigned>
+MaxTrip("max-trip", cl::init(100), cl::desc("Most iterations of a loop"));
+
+static cl::opt<unsigned>
+NumBinaryOps("binary-ops", cl::init(3),
+             cl::desc("Number of user-defined binary operators (up to 5)"));
+
+static cl::opt<unsigned>
+NumUnaryOps("unary-ops", cl::init(2),
+            cl::desc("Number of user-defined unary operators (up to 5)"));
+
+enum CallGraphShape { graph_chain, graph_tree, graph_layered, graph_random };
+
+static cl::opt<CallGraphShape>
+CallGraph("call-graph", cl::init(graph_random),
+          cl::desc("Which definitions each definition may call"),
+          cl::values(clEnumValN(graph_chain, "chain",
+                                "only the one defined just before it"),
+                     clEnumValN(graph_tree, "tree",
+                                "its two children in a binary tree"),
+                     clEnumValN(graph_layered, "layered",
+                                "any in the layer below (see -layers)"),
+                     clEnumValN(graph_random, "random",
+                                "any defined before it"),
+                     clEnumValEnd));
+
+static cl::opt<unsigned>
+Layers("layers", cl::init(5), cl::desc("Layers for -call-graph=layered"));
+
+static cl::opt<double>
+MaxCost("max-cost", cl::init(1e5),
+        cl::desc("Most operations one call of a definition may estimate to"));
+
+static cl::opt<bool>
+Print("print", cl::desc("Print each top-level result with printd"));
+
+static std::mt19937 Rng;
+
+static double Uniform() {
+  return std::uniform_real_distribution<double>(0, 1)(Rng);
+}
+
+static unsigned Below(unsigned N) { return N ? Rng() % N : 0; }
+
+/// Def - A generated definition: what calling it takes and costs.
+struct Def {
+  std::string Name;
+  unsigned NumParams;
+  double Cost;
+};
+
+static std::vector<Def> Defs;
+
+/// BinaryOp - A binary operator the generator may use, with its mix weight.
+struct BinaryOp {
+  char Op;
+  double Weight;
+};
+
+static std::vector<BinaryOp> BinaryOps;
+static std::string UnaryOps;
+
+/// OpCost - The estimated cost of one use of each user-defined operator.
+static double OpCost[128];
+
+static const char UserBinaryChars[] = "|&^%>";
+static const char UserUnaryChars[] = "!~@$?";
+
+/// Scope - What the expression being generated can refer to.
+struct Scope {
+  std::vector<std::string> Vars;
+  std::vector<unsigned> Callees;  // Indices into Defs.
+  unsigned NextVar;
+};
+
+/// GenState - The body being generated and its remaining cost budget.
+struct GenState {
+  Scope S;
+  double Cost;
+  bool AllowCalls;
+};
+
+static std::string Number() {
+  char Buf[32];
+  snprintf(Buf, sizeof(Buf), "%.2f", Uniform() * 10);
+  return Buf;
+}
+
+static std::string Leaf(const GenState &G) {
+  if (!G.S.Vars.empty() && Uniform() < 0.7)
+    return G.S.Vars[Below(G.S.Vars.size())];
+  return Number();
+}
+
+/// SplitBudget - Divide Size nodes among N children, at least one each.
+static std::vector<unsigned> SplitBudget(unsigned Size, unsigned N) {
+  std::vector<unsigned> Parts(N, 1);
+  for (unsigned i = N; i < Size; ++i)
+    ++Parts[Below(N)];
+  return Parts;
+}
+
+/// GenExpr - Generate an expression of about Size nodes.  Mult is how many
+/// times the enclosing loops run it, which is what every operation in it
+/// costs against the definition's budget.
+static std::string GenExpr(GenState &G, unsigned Size, unsigned Depth,
+                           double Mult) {
+  G.Cost += Mult;
+  if (Size <= 1 || Depth >= MaxDepth || G.Cost > MaxCost)
+    return Leaf(G);
+
+  enum { k_binary, k_call, k_if, k_for, k_var, k_unary, NumKinds };
+  double Weights[NumKinds] = { 1, 0, 0, 0, 0, 0 };
+  if (G.AllowCalls && !G.S.Callees.empty())
+    Weights[k_call] = CallWeight;
+  if (Size >= 3) {
+    Weights[k_if] = IfWeight;
+    Weights[k_for] = LoopWeight;
+  }
+  Weights[k_var] = VarWeight;
+  if (!UnaryOps.empty())
+    Weights[k_unary] = UnaryWeight;
+  double Total = 0;
+  for (unsigned i = 0; i != NumKinds; ++i)
+    Total += Weights[i];
+  double Pick = Uniform() * Total;
+  unsigned Kind = 0;
+  while (Kind != NumKinds - 1 && Pick >= Weights[Kind])
+    Pick -= Weights[Kind++];
+
+  switch (Kind) {
+  case k_call: {
+    const Def &D = Defs[G.S.Callees[Below(G.S.Callees.size())]];
+    if (G.Cost + Mult * D.Cost > MaxCost)
+      break;
+    G.Cost += Mult * D.Cost;
+    std::string E = D.Name + "(";
+    std::vector<unsigned> Parts =
+      SplitBudget(std::max(Size - 1, D.NumParams), std::max(D.NumParams, 1U));
+    for (unsigned i = 0; i != D.NumParams; ++i) {
+      if (i)
+        E += ", ";
+      E += GenExpr(G, Parts[i], Depth + 1, Mult);
+    }
+    return E + ")";
+  }
+  case k_if: {
+    std::vector<unsigned> Parts = SplitBudget(Size - 1, 3);
+    std::string C = GenExpr(G, Parts[0], Depth + 1, Mult);
+    std::string T = GenExpr(G, Parts[1], Depth + 1, Mult);
+    std::string F = GenExpr(G, Parts[2], Depth + 1, Mult);
+    return "(if " + C + " then " + T + " else " + F + ")";
+  }
+  case k_for: {
+    // Even a leaf body costs Mult * (Trip + 1), so cap the trip count at what
+    // is left of the budget rather than overrunning it.
+    double Fits = (MaxCost - G.Cost) / Mult - 1;
+    if (Fits < 1)
+      return Leaf(G);
+    unsigned Trip = 1 + Below(std::min((double)MaxTrip, Fits));
+    char Var[16];
+    snprintf(Var, sizeof(Var), "i%u", G.S.NextVar++);
+    char Head[64];
+    snprintf(Head, sizeof(Head), "(for %s = 0, %s < %u in ", Var, Var, Trip);
+    G.S.Vars.push_back(Var);
+    std::string Body = GenExpr(G, Size - 1, Depth + 1, Mult * (Trip + 1));
+    G.S.Vars.pop_back();
+    return Head + Body + ")";
+  }
+  case k_var: {
+    std::vector<unsigned> Parts = SplitBudget(Size - 1, 2);
+    char Var[16];
+    snprintf(Var, sizeof(Var), "v%u", G.S.NextVar++);
+    std::string Init = GenExpr(G, Parts[0], Depth + 1, Mult);
+    G.S.Vars.push_back(Var);
+    std::string Body = GenExpr(G, Parts[1], Depth + 1, Mult);
+    G.S.Vars.pop_back();
+    return std::string("(var ") + Var + " = " + Init + " in " + Body + ")";
+  }
+  case k_unary: {
+    char Op = UnaryOps[Below(UnaryOps.size())];
+    // An operator body may hold loops of its own; if it doesn't fit, just
+    // generate the operand.
+    if (G.Cost + Mult * OpCost[(int)Op] > MaxCost)
+      return GenExpr(G, Size - 1, Depth + 1, Mult);
+    G.Cost += Mult * OpCost[(int)Op];
+    return std::string(1, Op) + "(" + GenExpr(G, Size - 1, Depth + 1, Mult) +
+           ")";
+  }
+  }
+
+  // A binary operator, or the fallback for anything that didn't fit.
+  double OpTotal = 0;
+  for (unsigned i = 0, e = BinaryOps.size(); i != e; ++i)
+    OpTotal += BinaryOps[i].Weight;
+  double OpPick = Uniform() * OpTotal;
+  unsigned Op = 0;
+  while (Op + 1 != BinaryOps.size() && OpPick >= BinaryOps[Op].Weight)
+    OpPick -= BinaryOps[Op++].Weight;
+  char OpChar = BinaryOps[Op].Op;
+  // A user-defined operator that doesn't fit the budget gives way to a
+  // built-in one, which costs nothing beyond the node itself.
+  if (G.Cost + Mult * OpCost[(int)OpChar] > MaxCost)
+    OpChar = "+-*<"[Below(4)];
+  G.Cost += Mult * OpCost[(int)OpChar];
+  std::vector<unsigned> Parts = SplitBudget(Size - 1, 2);
+  std::string L = GenExpr(G, Parts[0], Depth + 1, Mult);
+  std::string R = GenExpr(G, Parts[1], Depth + 1, Mult);
+  return "(" + L + " " + OpChar + " " + R + ")";
+}
+
+/// BodySize - Draw a body size from -size-dist.
+static unsigned BodySize() {
+  double Mean = std::max(1U, (unsigned)MeanSize);
+  double Size = Mean;
+  switch (SizeDist) {
+  case size_fixed:
+    break;
+  case size_uniform:
+    Size = 1 + Uniform() * (2 * Mean - 1);
+    break;
+  case size_geometric:
+    Size = std::geometric_distribution<unsigned>(1 / Mean)(Rng) + 1;
+    break;
+  case size_pareto:
+    // Shape 2 keeps the mean finite; the scale is chosen to hit it.
+    Size = Mean / 2 / std::sqrt(1 - Uniform());
+    break;
+  }
+  return std::max(1.0, std::min(Size, 1e6));
+}
+
+/// Callees - The definitions Defs[Index] may call under -call-graph.
+static std::vector<unsigned> Callees(unsigned Index) {
+  std::vector<unsigned> C;
+  switch (CallGraph) {
+  case graph_chain:
+    if (Index)
+      C.push_back(Index - 1);
+    break;
+  case graph_tree: {
+    // Number the tree from the last definition, so children come first.
+    unsigned R = NumDefs - 1 - Index;
+    for (unsigned Child = 2 * R + 1; Child <= 2 * R + 2; ++Child)
+      if (Child < NumDefs)
+        C.push_back(NumDefs - 1 - Child);
+    break;
+  }
+  case graph_layered: {
+    unsigned PerLayer = std::max(1U, NumDefs / std::max(1U, (unsigned)Layers));
+    unsigned Layer = Index / PerLayer;
+    if (Layer)
+      for (unsigned i = (Layer - 1) * PerLayer; i != Layer * PerLayer; ++i)
+        C.push_back(i);
+    break;
+  }
+  case graph_random:
+    for (unsigned i = 0; i != Index; ++i)
+      C.push_back(i);
+    break;
+  }
+  return C;
+}
+
+/// ParseOpMix - Fill BinaryOps from -op-mix and the user-defined operators.
+static bool ParseOpMix() {
+  std::string Mix = OpMix;
+  size_t Pos = 0;
+  while (Pos < Mix.size()) {
+    size_t Comma = Mix.find(',', Pos);
+    if (Comma == std::string::npos)
+      Comma = Mix.size();
+    std::string Item = Mix.substr(Pos, Comma - Pos);
+    Pos = Comma + 1;
+    size_t Colon = Item.rfind(':');
+    if (Colon == std::string::npos || Colon == 0) {
+      fprintf(stderr, "-op-mix: expected op:weight, got '%s'\n", Item.c_str());
+      return false;
+    }
+    std::string Op = Item.substr(0, Colon);
+    double Weight = atof(Item.c_str() + Colon + 1);
+    if (Op == "user") {
+      for (unsigned i = 0; i != NumBinaryOps; ++i) {
+        BinaryOp B = { UserBinaryChars[i], Weight / NumBinaryOps };
+        BinaryOps.push_back(B);
+      }
+    } else if (Op.size() == 1 && std::string("+-*<").find(Op[0]) !=
+                                   std::string::npos) {
+      BinaryOp B = { Op[0], Weight };
+      BinaryOps.push_back(B);
+    } else {
+      fprintf(stderr, "-op-mix: unknown operator '%s'\n", Op.c_str());
+      return false;
+    }
+  }
+  if (BinaryOps.empty()) {
+    fprintf(stderr, "-op-mix: no operators\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope program generator\n");
+  Rng.seed(Seed);
+  if (NumBinaryOps > 5 || NumUnaryOps > 5) {
+    fprintf(stderr, "At most 5 user-defined operators of each kind\n");
+    return 1;
+  }
+  if (!ParseOpMix())
+    return 1;
+
+  printf("# Generated by:");
+  for (int i = 1; i < argc; ++i)
+    printf(" %s", argv[i]);
+  printf("\n");
+  if (Print)
+    printf("extern printd(x);\n");
+
+  // User-defined operators.  Their bodies can't use user-defined binary
+  // operators, which don't exist yet, so only the built-in ones are in the
+  // mix while they are generated.
+  std::vector<BinaryOp> AllOps = BinaryOps;
+  BinaryOps.clear();
+  for (unsigned i = 0, e = AllOps.size(); i != e; ++i)
+    if (std::string(UserBinaryChars).find(AllOps[i].Op) == std::string::npos)
+      BinaryOps.push_back(AllOps[i]);
+  if (BinaryOps.empty()) {
+    BinaryOp Plus = { '+', 1 };
+    BinaryOps.push_back(Plus);
+  }
+  for (unsigned i = 0; i != NumUnaryOps; ++i) {
+    GenState G;
+    G.S.Vars.push_back("x");
+    G.S.NextVar = 0;
+    G.Cost = 0;
+    G.AllowCalls = false;
+    std::string Body = GenExpr(G, 3 + Below(5), 0, 1);
+    OpCost[(int)UserUnaryChars[i]] = G.Cost;
+    printf("def unary%c(x) %s;\n", UserUnaryChars[i], Body.c_str());
+  }
+  UnaryOps = std::string(UserUnaryChars, NumUnaryOps);
+  for (unsigned i = 0; i != NumBinaryOps; ++i) {
+    GenState G;
+    G.S.Vars.push_back("a");
+    G.S.Vars.push_back("b");
+    G.S.NextVar = 0;
+    G.Cost = 0;
+    G.AllowCalls = false;
+    unsigned Prec = 5 + Below(50);
+    std::string Body = GenExpr(G, 3 + Below(5), 0, 1);
+    OpCost[(int)UserBinaryChars[i]] = G.Cost;
+    printf("def binary%c %u (a b) %s;\n", UserBinaryChars[i], Prec,
+           Body.c_str());
+  }
+  BinaryOps = AllOps;
+
+  // The definitions.
+  for (unsigned i = 0; i != NumDefs; ++i) {
+    Def D;
+    char Name[16];
+    snprintf(Name, sizeof(Name), "f%u", i);
+    D.Name = Name;
+    D.NumParams = Below(MaxParams + 1);
+
+    GenState G;
+    G.S.Callees = Callees(i);
+    G.S.NextVar = 0;
+    G.Cost = 0;
+    G.AllowCalls = true;
+    std::string Params;
+    for (unsigned p = 0; p != D.NumParams; ++p) {
+      char Param[16];
+      snprintf(Param, sizeof(Param), "p%u", p);
+      G.S.Vars.push_back(Param);
+      Params += (p ? " " : "") + std::string(Param);
+    }
+    std::string Body = GenExpr(G, BodySize(), 0, 1);
+    D.Cost = G.Cost;
+    Defs.push_back(D);
+    printf("def %s(%s)\n  %s;\n", D.Name.c_str(), Params.c_str(),
+           Body.c_str());
+  }
+
+  // Top-level expressions call the definitions nothing else calls, or any of
+  // them if the call graph is random.
+  std::vector<unsigned> Roots;
+  std::vector<bool> Called(NumDefs);
+  for (unsigned i = 0; i != NumDefs; ++i) {
+    std::vector<unsigned> C = Callees(i);
+    for (unsigned j = 0, e = C.size(); j != e; ++j)
+      Called[C[j]] = true;
+  }
+  for (unsigned i = 0; i != NumDefs; ++i)
+    if (!Called[i] || CallGraph == graph_random)
+      Roots.push_back(i);
+
+  for (unsigned i = 0; i != NumExprs && !Roots.empty(); ++i) {
+    const Def &D = Defs[Roots[Below(Roots.size())]];
+    std::string E = D.Name + "(";
+    for (unsigned p = 0; p != D.NumParams; ++p)
+      E += (p ? ", " : "") + Number();
+    E += ")";
+    printf("%s;\n", Print ? ("printd(" + E + ")").c_str() : E.c_str());
+  }
+  return 0;
+}
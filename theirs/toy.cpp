@@ -1,20 +1,70 @@
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/Verifier.h"
 //#include "llvm/Analysis/Verifier.h"
 #include "llvm/PassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Vectorize.h"
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
 #include <cstdio>
+#include <cstring>
+#include <cxxabi.h>
+#include <deque>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <future>
+#include <limits>
+#include <linux/perf_event.h>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <random>
+#include <set>
 #include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <ucontext.h>
+#include <unistd.h>
 #include <vector>
 using namespace llvm;
 
@@ -41,23 +91,82 @@ enum Token {
   tok_binary = -11, tok_unary = -12,
   
   // var definition
-  tok_var = -13
+  tok_var = -13,
+
+  // linkage and attributes
+  tok_export = -14, tok_cold = -15
 };
 
 static std::string IdentifierStr;  // Filled in if tok_identifier
 static double NumVal;              // Filled in if tok_number
 
-/// gettok - Return the next token from standard input.
+/// SourceLocation - A line and column in the current source file, from 1.
+struct SourceLocation {
+  int Line;
+  int Col;
+};
+
+/// LexLoc is the location of the last character read; CurLoc is where the
+/// token gettok last returned starts.
+static SourceLocation LexLoc = { 1, 0 };
+static SourceLocation CurLoc;
+
+/// InputFile - The file the lexer is reading source from.  Source files
+/// queued in PendingInputs are read after it, in order.
+static FILE *InputFile = stdin;
+static std::vector<FILE*> PendingInputs;
+
+/// RecordOut - Where -record writes the input as it is read, if anywhere.
+static FILE *RecordOut;
+static void RecordInput(int C);
+
+/// readchar - Return the next source character, moving on to the next input
+/// file when the current one runs out.
+static int readchar() {
+  int C = getc(InputFile);
+  if (C == EOF && !PendingInputs.empty()) {
+    if (InputFile != stdin)
+      fclose(InputFile);
+    InputFile = PendingInputs.front();
+    PendingInputs.erase(PendingInputs.begin());
+    C = '\n';  // Keep tokens from running across files.
+    LexLoc.Line = 0;  // The '\n' moves to line 1 of the new file.
+  }
+  if (C == '\n') {
+    ++LexLoc.Line;
+    LexLoc.Col = 0;
+  } else {
+    ++LexLoc.Col;
+  }
+  if (RecordOut && C != EOF)
+    RecordInput(C);
+  return C;
+}
+
+/// LastChar - The character after the last token, not yet consumed.
+static int LastChar = ' ';
+
+/// ResetLexer - Start lexing F from scratch, forgetting the current input.
+static void ResetLexer(FILE *F) {
+  InputFile = F;
+  PendingInputs.clear();
+  LastChar = ' ';
+  LexLoc.Line = 1;
+  LexLoc.Col = 0;
+}
+
+/// gettok - Return the next token from the input.
 static int gettok() {
-  static int LastChar = ' ';
 
   // Skip any whitespace.
   while (isspace(LastChar))
-    LastChar = getchar();
+    LastChar = readchar();
+
+  CurLoc = LexLoc;
 
   if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
     IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
+    while (isalnum((LastChar = readchar())))
       IdentifierStr += LastChar;
 
     if (IdentifierStr == "def") return tok_def;
@@ -70,6 +179,8 @@ static int gettok() {
     if (IdentifierStr == "binary") return tok_binary;
     if (IdentifierStr == "unary") return tok_unary;
     if (IdentifierStr == "var") return tok_var;
+    if (IdentifierStr == "export") return tok_export;
+    if (IdentifierStr == "cold") return tok_cold;
     return tok_identifier;
   }
 
@@ -77,7 +188,7 @@ static int gettok() {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = readchar();
     } while (isdigit(LastChar) || LastChar == '.');
 
     NumVal = strtod(NumStr.c_str(), 0);
@@ -86,7 +197,7 @@ static int gettok() {
 
   if (LastChar == '#') {
     // Comment until end of line.
-    do LastChar = getchar();
+    do LastChar = readchar();
     while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
     
     if (LastChar != EOF)
@@ -99,7 +210,7 @@ static int gettok() {
 
   // Otherwise, just return the character as its ascii value.
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = readchar();
   return ThisChar;
 }
 
@@ -107,11 +218,27 @@ static int gettok() {
 // Abstract Syntax Tree (aka Parse Tree)
 //===----------------------------------------------------------------------===//
 namespace {
+struct BatchEnv;
+class FunctionAST;
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST {
 public:
   virtual ~ExprAST() {}
   virtual Value *Codegen() = 0;
+
+  /// isBatchable - Return true if EvalBatch can evaluate this expression.
+  virtual bool isBatchable() const { return false; }
+
+  /// EvalBatch - Interpret this expression for all Env.N rows of Env at once,
+  /// writing one result per row to Out.
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const {
+    llvm_unreachable("expression can't be evaluated in batches");
+  }
+
+  /// Profile - Append a structural encoding of this expression to ID.  Two
+  /// expressions with the same encoding generate identical code.
+  virtual void Profile(std::string &ID) const = 0;
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -120,6 +247,9 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double val) : Val(val) {}
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+  virtual bool isBatchable() const;
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const;
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
@@ -129,36 +259,57 @@ public:
   VariableExprAST(const std::string &name) : Name(name) {}
   const std::string &getName() const { return Name; }
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+  virtual bool isBatchable() const;
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const;
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
 class UnaryExprAST : public ExprAST {
   char Opcode;
   ExprAST *Operand;
+  // The operator's definition, filled in by isBatchable.
+  mutable const FunctionAST *BatchDef;
 public:
   UnaryExprAST(char opcode, ExprAST *operand) 
-    : Opcode(opcode), Operand(operand) {}
+    : Opcode(opcode), Operand(operand), BatchDef(0) {}
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+  virtual bool isBatchable() const;
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const;
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
   char Op;
   ExprAST *LHS, *RHS;
+  // A user-defined operator's definition, filled in by isBatchable.
+  mutable const FunctionAST *BatchDef;
 public:
   BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs) 
-    : Op(op), LHS(lhs), RHS(rhs) {}
+    : Op(op), LHS(lhs), RHS(rhs), BatchDef(0) {}
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+  virtual bool isBatchable() const;
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const;
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
   std::string Callee;
   std::vector<ExprAST*> Args;
+  SourceLocation Loc;
+  // What the batch interpreter calls, filled in by isBatchable.
+  mutable const FunctionAST *BatchDef;
+  mutable void *BatchNative;
 public:
-  CallExprAST(const std::string &callee, std::vector<ExprAST*> &args)
-    : Callee(callee), Args(args) {}
+  CallExprAST(const std::string &callee, std::vector<ExprAST*> &args,
+              SourceLocation loc)
+    : Callee(callee), Args(args), Loc(loc), BatchDef(0), BatchNative(0) {}
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+  virtual bool isBatchable() const;
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const;
 };
 
 /// IfExprAST - Expression class for if/then/else.
@@ -168,17 +319,25 @@ public:
   IfExprAST(ExprAST *cond, ExprAST *then, ExprAST *_else)
   : Cond(cond), Then(then), Else(_else) {}
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+  virtual bool isBatchable() const;
+  virtual void EvalBatch(const BatchEnv &Env, double *Out) const;
 };
 
 /// ForExprAST - Expression class for for/in.
 class ForExprAST : public ExprAST {
   std::string VarName;
   ExprAST *Start, *End, *Step, *Body;
+  // The loop's extent in the source, from 'for' to just past the body.
+  SourceLocation Loc, EndLoc;
 public:
   ForExprAST(const std::string &varname, ExprAST *start, ExprAST *end,
-             ExprAST *step, ExprAST *body)
-    : VarName(varname), Start(start), End(end), Step(step), Body(body) {}
+             ExprAST *step, ExprAST *body, SourceLocation loc,
+             SourceLocation endloc)
+    : VarName(varname), Start(start), End(end), Step(step), Body(body),
+      Loc(loc), EndLoc(endloc) {}
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
 };
 
 /// VarExprAST - Expression class for var/in
@@ -191,6 +350,14 @@ public:
   : VarNames(varnames), Body(body) {}
   
   virtual Value *Codegen();
+  virtual void Profile(std::string &ID) const;
+};
+
+/// FFIType - The C types an 'extern' may declare for its arguments and result.
+/// Kaleidoscope values are always doubles, so calls convert at the call site.
+enum FFIType {
+  ffi_f64, ffi_f32, ffi_i32, ffi_i64, ffi_ptr,
+  ffi_void  // Only valid as a result type.
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -198,13 +365,25 @@ public:
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<FFIType> ArgTypes;  // Empty unless this is a typed extern.
+  FFIType RetType;
   bool isOperator;
+  bool Cold;            // Rarely called, e.g. an error handler.
   unsigned Precedence;  // Precedence if a binary op.
 public:
   PrototypeAST(const std::string &name, const std::vector<std::string> &args,
                bool isoperator = false, unsigned prec = 0)
-  : Name(name), Args(args), isOperator(isoperator), Precedence(prec) {}
-  
+  : Name(name), Args(args), RetType(ffi_f64), isOperator(isoperator),
+    Cold(false), Precedence(prec) {}
+
+  PrototypeAST(const std::string &name, const std::vector<std::string> &args,
+               const std::vector<FFIType> &argtypes, FFIType rettype)
+  : Name(name), Args(args), ArgTypes(argtypes), RetType(rettype),
+    isOperator(false), Cold(false), Precedence(0) {}
+
+  bool isCold() const { return Cold; }
+  void setCold() { Cold = true; }
+
   bool isUnaryOp() const { return isOperator && Args.size() == 1; }
   bool isBinaryOp() const { return isOperator && Args.size() == 2; }
   
@@ -214,21 +393,37 @@ public:
   }
   
   unsigned getBinaryPrecedence() const { return Precedence; }
+  const std::string &getName() const { return Name; }
+  const std::vector<std::string> &getArgs() const { return Args; }
   
   Function *Codegen();
   
   void CreateArgumentAllocas(Function *F);
 };
 
-/// FunctionAST - This class represents a function definition itself.
+/// FunctionAST - This class represents a function definition itself.  Only
+/// exported functions are visible outside the module; the rest are internal
+/// and use the fast calling convention so the optimizer may rewrite them.
 class FunctionAST {
   PrototypeAST *Proto;
   ExprAST *Body;
+  bool Exported;
 public:
-  FunctionAST(PrototypeAST *proto, ExprAST *body)
-    : Proto(proto), Body(body) {}
+  FunctionAST(PrototypeAST *proto, ExprAST *body, bool exported = false)
+    : Proto(proto), Body(body), Exported(exported) {}
   
+  const std::string &getName() const { return Proto->getName(); }
+  const PrototypeAST *getProto() const { return Proto; }
+  const ExprAST *getBody() const { return Body; }
+
   Function *Codegen();
+
+  /// Profile - Return the structural encoding of this definition, with the
+  /// argument names replaced by their positions.
+  std::string Profile() const;
+
+private:
+  Function *CodegenFolded(Function *Canonical);
 };
 } // end anonymous namespace
 
@@ -271,6 +466,7 @@ static ExprAST *ParseExpression();
 ///   ::= identifier '(' expression* ')'
 static ExprAST *ParseIdentifierExpr() {
   std::string IdName = IdentifierStr;
+  SourceLocation IdLoc = CurLoc;
   
   getNextToken();  // eat identifier.
   
@@ -297,7 +493,7 @@ static ExprAST *ParseIdentifierExpr() {
   // Eat the ')'.
   getNextToken();
   
-  return new CallExprAST(IdName, Args);
+  return new CallExprAST(IdName, Args, IdLoc);
 }
 
 /// numberexpr ::= number
@@ -347,6 +543,7 @@ static ExprAST *ParseIfExpr() {
 
 /// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
 static ExprAST *ParseForExpr() {
+  SourceLocation ForLoc = CurLoc;
   getNextToken();  // eat the for.
 
   if (CurTok != tok_identifier)
@@ -384,7 +581,7 @@ static ExprAST *ParseForExpr() {
   ExprAST *Body = ParseExpression();
   if (Body == 0) return 0;
 
-  return new ForExprAST(IdName, Start, End, Step, Body);
+  return new ForExprAST(IdName, Start, End, Step, Body, ForLoc, CurLoc);
 }
 
 /// varexpr ::= 'var' identifier ('=' expression)? 
@@ -510,12 +707,36 @@ static ExprAST *ParseExpression() {
   return ParseBinOpRHS(0, LHS);
 }
 
+/// ffitype ::= 'f64' | 'f32' | 'i32' | 'i64' | 'ptr' | 'void'
+static bool ParseFFIType(FFIType &Ty) {
+  if (CurTok != tok_identifier)
+    return false;
+  if (IdentifierStr == "f64") Ty = ffi_f64;
+  else if (IdentifierStr == "f32") Ty = ffi_f32;
+  else if (IdentifierStr == "i32") Ty = ffi_i32;
+  else if (IdentifierStr == "i64") Ty = ffi_i64;
+  else if (IdentifierStr == "ptr") Ty = ffi_ptr;
+  else if (IdentifierStr == "void") Ty = ffi_void;
+  else return false;
+  getNextToken();  // eat the type.
+  return true;
+}
+
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
-static PrototypeAST *ParsePrototype() {
+///   ::= 'cold'? id '(' (id (':' ffitype)?)* ')' (':' ffitype)?
+///   ::= 'cold'? binary LETTER number? (id, id)
+///   ::= 'cold'? unary LETTER (id)
+///
+/// Argument and result types are only accepted when AllowTypes is set, which
+/// is the case for 'extern' declarations.
+static PrototypeAST *ParsePrototype(bool AllowTypes = false) {
   std::string FnName;
+
+  bool IsCold = false;
+  if (CurTok == tok_cold) {
+    IsCold = true;
+    getNextToken();  // eat cold.
+  }
   
   unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned BinaryPrecedence = 30;
@@ -560,38 +781,81 @@ static PrototypeAST *ParsePrototype() {
     return ErrorP("Expected '(' in prototype");
   
   std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
+  std::vector<FFIType> ArgTypes;
+  bool HasTypes = false;
+  getNextToken();  // eat '('.
+  while (CurTok == tok_identifier) {
     ArgNames.push_back(IdentifierStr);
+    getNextToken();  // eat identifier.
+
+    FFIType Ty = ffi_f64;
+    if (CurTok == ':') {
+      if (!AllowTypes)
+        return ErrorP("Argument types are only allowed on 'extern'");
+      getNextToken();  // eat ':'.
+      if (!ParseFFIType(Ty) || Ty == ffi_void)
+        return ErrorP("Expected argument type (i32, i64, f32, f64 or ptr)");
+      HasTypes = true;
+    }
+    ArgTypes.push_back(Ty);
+  }
   if (CurTok != ')')
     return ErrorP("Expected ')' in prototype");
   
   // success.
   getNextToken();  // eat ')'.
+
+  // Read the optional result type.
+  FFIType RetType = ffi_f64;
+  if (AllowTypes && CurTok == ':') {
+    getNextToken();  // eat ':'.
+    if (!ParseFFIType(RetType))
+      return ErrorP("Expected result type (i32, i64, f32, f64, ptr or void)");
+    HasTypes = true;
+  }
   
   // Verify right number of names for operator.
   if (Kind && ArgNames.size() != Kind)
     return ErrorP("Invalid number of operands for operator");
-  
-  return new PrototypeAST(FnName, ArgNames, Kind != 0, BinaryPrecedence);
+
+  PrototypeAST *Proto;
+  if (HasTypes) {
+    if (Kind)
+      return ErrorP("Operators cannot have typed operands");
+    Proto = new PrototypeAST(FnName, ArgNames, ArgTypes, RetType);
+  } else {
+    Proto = new PrototypeAST(FnName, ArgNames, Kind != 0, BinaryPrecedence);
+  }
+  if (IsCold)
+    Proto->setCold();
+  return Proto;
 }
 
-/// definition ::= 'def' prototype expression
+/// definition ::= 'export'? 'def' prototype expression
 static FunctionAST *ParseDefinition() {
+  bool Exported = false;
+  if (CurTok == tok_export) {
+    Exported = true;
+    getNextToken();  // eat export.
+    if (CurTok != tok_def)
+      return ErrorF("Expected 'def' after 'export'");
+  }
+
   getNextToken();  // eat def.
   PrototypeAST *Proto = ParsePrototype();
   if (Proto == 0) return 0;
 
   if (ExprAST *E = ParseExpression())
-    return new FunctionAST(Proto, E);
+    return new FunctionAST(Proto, E, Exported);
   return 0;
 }
 
 /// toplevelexpr ::= expression
 static FunctionAST *ParseTopLevelExpr() {
   if (ExprAST *E = ParseExpression()) {
-    // Make an anonymous proto.
+    // Make an anonymous proto.  The driver calls it directly, so export it.
     PrototypeAST *Proto = new PrototypeAST("", std::vector<std::string>());
-    return new FunctionAST(Proto, E);
+    return new FunctionAST(Proto, E, /*exported=*/true);
   }
   return 0;
 }
@@ -599,7 +863,588 @@ static FunctionAST *ParseTopLevelExpr() {
 /// external ::= 'extern' prototype
 static PrototypeAST *ParseExtern() {
   getNextToken();  // eat extern.
-  return ParsePrototype();
+  return ParsePrototype(/*AllowTypes=*/true);
+}
+
+//===----------------------------------------------------------------------===//
+// Structural Profiles
+//===----------------------------------------------------------------------===//
+
+// Profiles are a prefix encoding of the AST.  Every node writes a one letter
+// tag followed by its operands, and names are terminated by ';', so equal
+// strings mean equal trees.  Argument names are replaced by their position,
+// which lets "def f(a) a*2" and "def g(x) x*2" share a profile.
+
+/// ProfileArgs - Maps the arguments of the definition being profiled to
+/// their positions.
+static std::map<std::string, unsigned> ProfileArgs;
+
+/// ProfileCallees - If set, profiling also collects the names of the
+/// functions the tree calls, including user-defined operators.
+static std::set<std::string> *ProfileCallees;
+
+static Function *LookupFunction(const std::string &Name);
+
+static void ProfileName(std::string &ID, const std::string &Name) {
+  std::map<std::string, unsigned>::const_iterator I = ProfileArgs.find(Name);
+  if (I != ProfileArgs.end()) {
+    // '$' can't appear in an identifier, so this can't collide with a name.
+    char Buf[16];
+    snprintf(Buf, sizeof(Buf), "$%u", I->second);
+    ID += Buf;
+  } else {
+    ID += Name;
+  }
+  ID += ';';
+}
+
+void NumberExprAST::Profile(std::string &ID) const {
+  // Use the bit pattern so that, e.g., 0.0 and -0.0 stay distinct.
+  uint64_t Bits;
+  memcpy(&Bits, &Val, sizeof(Bits));
+  char Buf[24];
+  snprintf(Buf, sizeof(Buf), "N%llx;", (unsigned long long)Bits);
+  ID += Buf;
+}
+
+void VariableExprAST::Profile(std::string &ID) const {
+  ID += 'V';
+  ProfileName(ID, Name);
+}
+
+void UnaryExprAST::Profile(std::string &ID) const {
+  ID += 'U';
+  ID += Opcode;
+  if (ProfileCallees)
+    ProfileCallees->insert(std::string("unary") + Opcode);
+  Operand->Profile(ID);
+}
+
+void BinaryExprAST::Profile(std::string &ID) const {
+  ID += 'B';
+  ID += Op;
+  if (ProfileCallees && !strchr("=<+-*", Op))
+    ProfileCallees->insert(std::string("binary") + Op);
+  LHS->Profile(ID);
+  RHS->Profile(ID);
+}
+
+void CallExprAST::Profile(std::string &ID) const {
+  // A call to the arraylen/arrayget builtin is a different tree from a call
+  // to a definition the program later gives the same name.
+  bool Builtin = !LookupFunction(Callee) &&
+                 ((Callee == "arraylen" && Args.size() == 1) ||
+                  (Callee == "arrayget" && Args.size() == 2));
+  char Buf[16];
+  snprintf(Buf, sizeof(Buf), "%c%u;", Builtin ? 'K' : 'C',
+           (unsigned)Args.size());
+  ID += Buf;
+  ID += Callee;
+  ID += ';';
+  if (ProfileCallees)
+    ProfileCallees->insert(Callee);
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    Args[i]->Profile(ID);
+}
+
+void IfExprAST::Profile(std::string &ID) const {
+  ID += 'I';
+  Cond->Profile(ID);
+  Then->Profile(ID);
+  Else->Profile(ID);
+}
+
+void ForExprAST::Profile(std::string &ID) const {
+  ID += 'F';
+  ProfileName(ID, VarName);
+  Start->Profile(ID);
+  End->Profile(ID);
+  if (Step)
+    Step->Profile(ID);
+  else
+    ID += '-';
+  Body->Profile(ID);
+}
+
+void VarExprAST::Profile(std::string &ID) const {
+  char Buf[16];
+  snprintf(Buf, sizeof(Buf), "L%u;", (unsigned)VarNames.size());
+  ID += Buf;
+  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    ProfileName(ID, VarNames[i].first);
+    if (VarNames[i].second)
+      VarNames[i].second->Profile(ID);
+    else
+      ID += '-';
+  }
+  Body->Profile(ID);
+}
+
+std::string FunctionAST::Profile() const {
+  const std::vector<std::string> &Args = Proto->getArgs();
+  ProfileArgs.clear();
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    ProfileArgs[Args[i]] = i;
+
+  // Anonymous top-level expressions only fold with each other.
+  char Buf[16];
+  snprintf(Buf, sizeof(Buf), "%c%u%s;", Proto->getName().empty() ? 'A' : 'P',
+           (unsigned)Args.size(), Proto->isCold() ? "c" : "");
+  std::string ID = Buf;
+  Body->Profile(ID);
+  ProfileArgs.clear();
+  return ID;
+}
+
+//===----------------------------------------------------------------------===//
+// Metrics
+//===----------------------------------------------------------------------===//
+
+// Latency histograms, counters and gauges, always collected and exported in
+// the Prometheus text format with -metrics-socket or -metrics-file.
+// Recording is a few relaxed atomic adds into a shard owned by the calling
+// thread, so threads never contend.  The shards live in shared memory mapped
+// before any fork, which lets the exporter in the -serve scheduler or a -rows
+// coordinator report its workers' numbers too.
+//
+// Histograms use two buckets per power of two of nanoseconds, from 256ns up
+// to about two minutes, which keeps the relative error under 50% at a fixed
+// size.
+
+enum MetricHistogram {
+  hist_parse, hist_codegen, hist_optimize, hist_jit, hist_execute,
+  hist_request, NumMetricHistograms
+};
+
+enum MetricCounter {
+  ctr_folded, ctr_code_cache_hits, ctr_code_cache_misses, ctr_serve_rejected,
+  NumMetricCounters
+};
+
+enum MetricGauge {
+  gauge_serve_queued, gauge_serve_receiving, gauge_serve_busy,
+  gauge_compile_queue, NumMetricGauges
+};
+
+static const char *const HistogramNames[NumMetricHistograms][2] = {
+  { "toy_parse_seconds", "Time spent parsing a top-level item" },
+  { "toy_codegen_seconds",
+    "Time spent generating IR for an item, including toy_optimize_seconds" },
+  { "toy_optimize_seconds", "Time spent in IR optimization passes" },
+  { "toy_jit_seconds", "Time spent emitting machine code" },
+  { "toy_execute_seconds", "Time spent running top-level expressions" },
+  { "toy_serve_request_seconds",
+    "Time from receiving a -serve request to its worker finishing it" }
+};
+
+static const char *const CounterNames[NumMetricCounters][2] = {
+  { "toy_folded_definitions_total",
+    "Definitions folded into an identical earlier one" },
+  { "toy_code_cache_hits_total", "Definitions loaded from the code cache" },
+  { "toy_code_cache_misses_total", "Definitions added to the code cache" },
+  { "toy_serve_rejected_total", "-serve requests turned away" }
+};
+
+static const char *const GaugeNames[NumMetricGauges][2] = {
+  { "toy_serve_queued", "-serve requests waiting for a worker" },
+  { "toy_serve_receiving", "-serve requests still being received" },
+  { "toy_serve_busy_workers", "-serve workers running a request" },
+  { "toy_compile_queue_depth", "Units waiting in the async compile queue" }
+};
+
+static const unsigned MinLatencyOctave = 8, MaxLatencyOctave = 37;
+static const unsigned NumLatencyBuckets =
+  2 + 2 * (MaxLatencyOctave - MinLatencyOctave + 1);
+static const unsigned MaxMetricShards = 256;
+
+namespace {
+struct MetricShard {
+  std::atomic<uint64_t> Buckets[NumMetricHistograms][NumLatencyBuckets];
+  std::atomic<uint64_t> SumNs[NumMetricHistograms];
+  std::atomic<uint64_t> Counters[NumMetricCounters];
+};
+
+struct MetricsRegion {
+  std::atomic<unsigned> ShardsUsed;
+  std::atomic<int64_t> Gauges[NumMetricGauges];
+  MetricShard Shards[MaxMetricShards];
+};
+} // end anonymous namespace
+
+static MetricsRegion *Metrics;
+static thread_local MetricShard *ThreadShard;
+
+/// ForgetThreadShard - After a fork, the child claims shards of its own.
+static void ForgetThreadShard() { ThreadShard = 0; }
+static void ForgetPerfGroup();
+
+/// InitMetrics - Map the shared, zeroed metrics region.
+static void InitMetrics() {
+  void *Map = mmap(0, sizeof(MetricsRegion), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (Map == MAP_FAILED) {
+    perror("metrics");
+    exit(1);
+  }
+  Metrics = (MetricsRegion *)Map;
+  pthread_atfork(0, 0, ForgetThreadShard);
+  pthread_atfork(0, 0, ForgetPerfGroup);
+}
+
+/// getThreadShard - The calling thread's shard.  If they run out, the last
+/// one is shared, which is still correct, just contended.
+static MetricShard &getThreadShard() {
+  if (!ThreadShard) {
+    unsigned Idx = Metrics->ShardsUsed.fetch_add(1, std::memory_order_relaxed);
+    ThreadShard = &Metrics->Shards[std::min(Idx, MaxMetricShards - 1)];
+  }
+  return *ThreadShard;
+}
+
+static uint64_t MetricNow() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// LatencyBucket - The histogram bucket for a latency of Ns nanoseconds.
+static unsigned LatencyBucket(uint64_t Ns) {
+  if (Ns < (1ULL << MinLatencyOctave))
+    return 0;
+  unsigned Octave = 63 - __builtin_clzll(Ns);
+  if (Octave > MaxLatencyOctave)
+    return NumLatencyBuckets - 1;
+  return 1 + 2 * (Octave - MinLatencyOctave) + ((Ns >> (Octave - 1)) & 1);
+}
+
+/// LatencyBucketBound - The upper bound of bucket B in seconds.
+static double LatencyBucketBound(unsigned B) {
+  if (B == 0)
+    return (1ULL << MinLatencyOctave) * 1e-9;
+  unsigned Octave = MinLatencyOctave + (B - 1) / 2;
+  double Base = (double)(1ULL << Octave) * 1e-9;
+  return (B - 1) % 2 ? 2 * Base : 1.5 * Base;
+}
+
+static void RecordLatency(MetricHistogram H, uint64_t StartNs) {
+  uint64_t Ns = MetricNow() - StartNs;
+  MetricShard &S = getThreadShard();
+  S.Buckets[H][LatencyBucket(Ns)].fetch_add(1, std::memory_order_relaxed);
+  S.SumNs[H].fetch_add(Ns, std::memory_order_relaxed);
+}
+
+/// MetricSumNs - The total time recorded in histogram H by every shard.
+static uint64_t MetricSumNs(MetricHistogram H) {
+  uint64_t Sum = 0;
+  unsigned Used = std::min(Metrics->ShardsUsed.load(), MaxMetricShards);
+  for (unsigned S = 0; S != Used; ++S)
+    Sum += Metrics->Shards[S].SumNs[H].load(std::memory_order_relaxed);
+  return Sum;
+}
+
+static void CountMetric(MetricCounter C, uint64_t N = 1) {
+  getThreadShard().Counters[C].fetch_add(N, std::memory_order_relaxed);
+}
+
+static void SetGauge(MetricGauge G, int64_t V) {
+  Metrics->Gauges[G].store(V, std::memory_order_relaxed);
+}
+
+// With -perf-counters, every timed phase of every item is also measured
+// with the CPU's performance counters: cycles, instructions, cache misses
+// and branch misses, counted for the calling thread in user mode only, so
+// no special privileges are needed.  Each measurement is reported as it
+// completes, and the totals per phase at exit; the instructions per cycle
+// and misses per thousand instructions show whether code is compute-,
+// memory- or branch-bound.
+
+static cl::opt<bool>
+PerfCounters("perf-counters",
+             cl::desc("Report hardware performance counters for each "
+                      "compile phase and evaluation"));
+
+enum PerfEvent {
+  perf_cycles, perf_instructions, perf_cache_misses, perf_branch_misses,
+  NumPerfEvents
+};
+
+static const char *const PhaseNames[NumMetricHistograms] = {
+  "parse", "codegen", "optimize", "jit", "execute", "request"
+};
+
+/// PerfGroup - The calling thread's counter group leader: -2 until it is
+/// opened, -1 if counters can't be used.
+static thread_local int PerfGroup = -2;
+static std::atomic<bool> PerfUnavailable;
+static std::atomic<uint64_t> PerfTotals[NumMetricHistograms][NumPerfEvents];
+static std::atomic<uint64_t> PerfItems[NumMetricHistograms];
+
+/// ForgetPerfGroup - After a fork, the inherited counters still count the
+/// parent's thread, and the child may already have closed their descriptors
+/// (server workers and shards close everything), so open new ones.
+static void ForgetPerfGroup() { PerfGroup = -2; }
+
+/// OpenPerfGroup - Open the counters for the calling thread as one group, so
+/// that they are scheduled onto the hardware together.
+static int OpenPerfGroup() {
+  static const uint64_t Configs[NumPerfEvents] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  int FDs[NumPerfEvents];
+  for (unsigned i = 0; i != NumPerfEvents; ++i) {
+    perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.config = Configs[i];
+    Attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    FDs[i] = syscall(__NR_perf_event_open, &Attr, 0, -1,
+                     i ? FDs[0] : -1, 0);
+    if (FDs[i] < 0) {
+      int SavedErrno = errno;
+      while (i-- != 0)
+        close(FDs[i]);
+      errno = SavedErrno;
+      return -1;
+    }
+  }
+  return FDs[0];
+}
+
+/// ReadPerfCounters - Read the calling thread's counters, scaled up if the
+/// kernel had to multiplex them with other users.
+static bool ReadPerfCounters(uint64_t Values[NumPerfEvents]) {
+  if (PerfGroup == -2) {
+    PerfGroup = OpenPerfGroup();
+    if (PerfGroup < 0 && !PerfUnavailable.exchange(true))
+      fprintf(stderr, "Warning: hardware counters unavailable: %s\n",
+              strerror(errno));
+  }
+  if (PerfGroup < 0)
+    return false;
+
+  // nr, time enabled, time running, then one value per event.
+  uint64_t Buf[3 + NumPerfEvents];
+  if (read(PerfGroup, Buf, sizeof(Buf)) != (ssize_t)sizeof(Buf))
+    return false;
+  double Scale = Buf[2] ? (double)Buf[1] / Buf[2] : 1.0;
+  for (unsigned i = 0; i != NumPerfEvents; ++i)
+    Values[i] = (uint64_t)(Buf[3 + i] * Scale);
+  return true;
+}
+
+/// PrintPerfCounts - Print one line of counts, with the derived ratios.
+static void PrintPerfCounts(const char *What, const uint64_t Counts[]) {
+  double KInstrs = Counts[perf_instructions] / 1000.0;
+  fprintf(stderr, "%s: %llu cycles, %llu instructions (%.2f IPC), "
+          "%llu cache misses (%.2f/1k instr), "
+          "%llu branch misses (%.2f/1k instr)\n", What,
+          (unsigned long long)Counts[perf_cycles],
+          (unsigned long long)Counts[perf_instructions],
+          Counts[perf_cycles] ? (double)Counts[perf_instructions] /
+                                Counts[perf_cycles] : 0.0,
+          (unsigned long long)Counts[perf_cache_misses],
+          KInstrs ? Counts[perf_cache_misses] / KInstrs : 0.0,
+          (unsigned long long)Counts[perf_branch_misses],
+          KInstrs ? Counts[perf_branch_misses] / KInstrs : 0.0);
+}
+
+/// RecordPerfCounts - Report one phase's counts and add them to the totals.
+static void RecordPerfCounts(MetricHistogram H, const uint64_t Start[],
+                             const uint64_t End[]) {
+  uint64_t Delta[NumPerfEvents];
+  for (unsigned i = 0; i != NumPerfEvents; ++i) {
+    Delta[i] = End[i] > Start[i] ? End[i] - Start[i] : 0;
+    PerfTotals[H][i].fetch_add(Delta[i], std::memory_order_relaxed);
+  }
+  PerfItems[H].fetch_add(1, std::memory_order_relaxed);
+  PrintPerfCounts((std::string("perf ") + PhaseNames[H]).c_str(), Delta);
+}
+
+/// FinishPerfCounters - Print the totals for each phase.
+static void FinishPerfCounters() {
+  if (!PerfCounters)
+    return;
+  for (unsigned H = 0; H != NumMetricHistograms; ++H) {
+    uint64_t Items = PerfItems[H].load();
+    if (!Items)
+      continue;
+    uint64_t Totals[NumPerfEvents];
+    for (unsigned i = 0; i != NumPerfEvents; ++i)
+      Totals[i] = PerfTotals[H][i].load();
+    char What[64];
+    snprintf(What, sizeof(What), "perf total %s (%llu items)", PhaseNames[H],
+             (unsigned long long)Items);
+    PrintPerfCounts(What, Totals);
+  }
+}
+
+namespace {
+/// MetricTimer - Records the time from its construction to stop(), or to
+/// its destruction if stop() isn't called.  With -perf-counters, it also
+/// measures the hardware counters over the same span.
+class MetricTimer {
+  MetricHistogram H;
+  uint64_t Start;
+  bool Stopped, Counting;
+  uint64_t StartCounts[NumPerfEvents];
+public:
+  explicit MetricTimer(MetricHistogram h) : H(h), Stopped(false) {
+    Counting = PerfCounters && ReadPerfCounters(StartCounts);
+    Start = MetricNow();
+  }
+  ~MetricTimer() { stop(); }
+  void stop() {
+    if (Stopped)
+      return;
+    Stopped = true;
+    RecordLatency(H, Start);
+    uint64_t EndCounts[NumPerfEvents];
+    if (Counting && ReadPerfCounters(EndCounts))
+      RecordPerfCounts(H, StartCounts, EndCounts);
+  }
+};
+} // end anonymous namespace
+
+/// FormatMetrics - Sum the shards and render them in the Prometheus text
+/// exposition format.
+static std::string FormatMetrics() {
+  std::string Out;
+  char Buf[256];
+  unsigned Used = std::min(Metrics->ShardsUsed.load(), MaxMetricShards);
+
+  for (unsigned H = 0; H != NumMetricHistograms; ++H) {
+    snprintf(Buf, sizeof(Buf), "# HELP %s %s\n# TYPE %s histogram\n",
+             HistogramNames[H][0], HistogramNames[H][1], HistogramNames[H][0]);
+    Out += Buf;
+    uint64_t Count = 0, SumNs = 0;
+    for (unsigned B = 0; B != NumLatencyBuckets; ++B) {
+      for (unsigned S = 0; S != Used; ++S)
+        Count += Metrics->Shards[S].Buckets[H][B].load(
+                   std::memory_order_relaxed);
+      if (B == NumLatencyBuckets - 1)
+        snprintf(Buf, sizeof(Buf), "%s_bucket{le=\"+Inf\"} %llu\n",
+                 HistogramNames[H][0], (unsigned long long)Count);
+      else
+        snprintf(Buf, sizeof(Buf), "%s_bucket{le=\"%g\"} %llu\n",
+                 HistogramNames[H][0], LatencyBucketBound(B),
+                 (unsigned long long)Count);
+      Out += Buf;
+    }
+    for (unsigned S = 0; S != Used; ++S)
+      SumNs += Metrics->Shards[S].SumNs[H].load(std::memory_order_relaxed);
+    snprintf(Buf, sizeof(Buf), "%s_sum %.9f\n%s_count %llu\n",
+             HistogramNames[H][0], SumNs * 1e-9, HistogramNames[H][0],
+             (unsigned long long)Count);
+    Out += Buf;
+  }
+
+  for (unsigned C = 0; C != NumMetricCounters; ++C) {
+    uint64_t Total = 0;
+    for (unsigned S = 0; S != Used; ++S)
+      Total += Metrics->Shards[S].Counters[C].load(std::memory_order_relaxed);
+    snprintf(Buf, sizeof(Buf), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+             CounterNames[C][0], CounterNames[C][1], CounterNames[C][0],
+             CounterNames[C][0], (unsigned long long)Total);
+    Out += Buf;
+  }
+
+  for (unsigned G = 0; G != NumMetricGauges; ++G) {
+    snprintf(Buf, sizeof(Buf), "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+             GaugeNames[G][0], GaugeNames[G][1], GaugeNames[G][0],
+             GaugeNames[G][0],
+             (long long)Metrics->Gauges[G].load(std::memory_order_relaxed));
+    Out += Buf;
+  }
+  return Out;
+}
+
+static cl::opt<std::string>
+MetricsSocket("metrics-socket", cl::value_desc("socket path"),
+              cl::desc("Serve metrics in the Prometheus text format to each "
+                       "connection on this Unix socket"));
+
+static cl::opt<std::string>
+MetricsFile("metrics-file", cl::value_desc("file"),
+            cl::desc("Rewrite this file with metrics in the Prometheus text "
+                     "format every second and at exit"));
+
+/// WriteMetricsFile - Replace MetricsFile atomically, so that a collector
+/// never reads half a file.
+static void WriteMetricsFile() {
+  std::string Text = FormatMetrics();
+  std::string Tmp = MetricsFile + ".tmp";
+  FILE *F = fopen(Tmp.c_str(), "w");
+  if (!F)
+    return;
+  fwrite(Text.data(), 1, Text.size(), F);
+  fclose(F);
+  rename(Tmp.c_str(), MetricsFile.c_str());
+}
+
+/// MetricsExporter - The exporter thread: answer metrics socket connections
+/// and rewrite the metrics file once a second.
+static void MetricsExporter(int Listener) {
+  while (1) {
+    pollfd P = { Listener, POLLIN, 0 };
+    int N = poll(&P, Listener < 0 ? 0 : 1, 1000);
+    if (N > 0) {
+      int Conn = accept(Listener, 0, 0);
+      if (Conn >= 0) {
+        // MSG_NOSIGNAL: a scraper that hangs up mustn't raise SIGPIPE.
+        std::string Text = FormatMetrics();
+        for (size_t Sent = 0; Sent < Text.size();) {
+          ssize_t W = send(Conn, Text.data() + Sent, Text.size() - Sent,
+                           MSG_NOSIGNAL);
+          if (W <= 0)
+            break;
+          Sent += W;
+        }
+        close(Conn);
+      }
+    } else if (!MetricsFile.empty()) {
+      WriteMetricsFile();
+    }
+  }
+}
+
+/// StartMetricsExporter - Start exporting if -metrics-socket or
+/// -metrics-file was given.
+static bool StartMetricsExporter() {
+  if (MetricsSocket.empty() && MetricsFile.empty())
+    return true;
+
+  int Listener = -1;
+  if (!MetricsSocket.empty()) {
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (MetricsSocket.size() >= sizeof(Addr.sun_path)) {
+      fprintf(stderr, "Socket path %s is too long\n", MetricsSocket.c_str());
+      return false;
+    }
+    strcpy(Addr.sun_path, MetricsSocket.c_str());
+    unlink(Addr.sun_path);
+    Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener < 0 || bind(Listener, (sockaddr*)&Addr, sizeof(Addr)) < 0 ||
+        listen(Listener, SOMAXCONN) < 0) {
+      perror(MetricsSocket.c_str());
+      return false;
+    }
+  }
+  std::thread(MetricsExporter, Listener).detach();
+  return true;
+}
+
+/// FinishMetrics - Write the final numbers and remove the socket.
+static void FinishMetrics() {
+  if (!MetricsFile.empty())
+    WriteMetricsFile();
+  if (!MetricsSocket.empty())
+    unlink(MetricsSocket.c_str());
 }
 
 //===----------------------------------------------------------------------===//
@@ -609,10 +1454,222 @@ static PrototypeAST *ParseExtern() {
 static Module *TheModule;
 static IRBuilder<> Builder(getGlobalContext());
 static std::map<std::string, AllocaInst*> NamedValues;
-static FunctionPassManager *TheFPM;
+
+/// LoopsEmitted - The number of for loops generated so far, so a definition
+/// can tell whether its body had any.
+static unsigned LoopsEmitted;
+
+static cl::opt<bool>
+BatchMode("batch",
+          cl::desc("Compile the whole input as one module, run "
+                   "interprocedural optimizations, then evaluate the "
+                   "top-level expressions in order"));
 
 Value *ErrorV(const char *Str) { Error(Str); return 0; }
 
+static cl::opt<bool>
+Remarks("remarks",
+        cl::desc("Report which loops and calls the optimizers transformed "
+                 "and which they gave up on, and why"));
+
+static cl::opt<std::string>
+RemarksFile("remarks-file", cl::init(""), cl::value_desc("file"),
+            cl::desc("Also write optimization remarks to <file> as YAML"));
+
+static cl::opt<bool>
+LoopOpts("loop-opts",
+         cl::desc("Rotate, hoist out of, and vectorize loops in each "
+                  "definition"));
+
+static bool RemarksEnabled() { return Remarks || !RemarksFile.empty(); }
+
+/// RemarkSite - A loop or call in the source that remarks can refer to.
+/// Calls are matched by their exact location, loops by the innermost range
+/// containing the remark.
+struct RemarkSite {
+  std::string Function;
+  SourceLocation Begin, End;
+  std::string What;
+};
+
+static std::vector<RemarkSite> LoopSites, CallSites;
+
+/// DebugScope - The scope debug locations in the current function refer to.
+/// Nothing here is real debug info; the locations only exist so that the
+/// optimizers can say where in the source their remarks apply.
+static MDNode *DebugScope;
+
+/// ClearDebugLoc - Forget the current function's debug locations.  Anything
+/// that starts generating code in another function calls this first, so that
+/// it doesn't inherit a location whose scope belongs elsewhere.
+static void ClearDebugLoc() {
+  Builder.SetCurrentDebugLocation(DebugLoc());
+  DebugScope = 0;
+}
+
+static void SetDebugLoc(SourceLocation Loc) {
+  if (DebugScope)
+    Builder.SetCurrentDebugLocation(DebugLoc::get(Loc.Line, Loc.Col,
+                                                  DebugScope));
+}
+
+static void AddRemarkSite(std::vector<RemarkSite> &Sites, SourceLocation Begin,
+                          SourceLocation End, const std::string &What) {
+  RemarkSite Site;
+  Site.Function = Builder.GetInsertBlock()->getParent()->getName().str();
+  Site.Begin = Begin;
+  Site.End = End;
+  Site.What = What;
+  Sites.push_back(Site);
+}
+
+static bool LocBefore(int Line, int Col, SourceLocation Loc) {
+  return Line < Loc.Line || (Line == Loc.Line && Col < Loc.Col);
+}
+
+/// DescribeRemarkSite - Name the source construct a remark from pass Pass at
+/// Line:Col in function Fn is about.
+static std::string DescribeRemarkSite(const std::string &Pass,
+                                      const std::string &Fn,
+                                      int Line, int Col) {
+  if (Pass == "inline") {
+    for (unsigned i = 0, e = CallSites.size(); i != e; ++i)
+      if (CallSites[i].Function == Fn && CallSites[i].Begin.Line == Line &&
+          CallSites[i].Begin.Col == Col)
+        return CallSites[i].What;
+    return "call";
+  }
+
+  // Loops are recorded outermost first, so the last match is the innermost.
+  const RemarkSite *Best = 0;
+  for (unsigned i = 0, e = LoopSites.size(); i != e; ++i) {
+    const RemarkSite &S = LoopSites[i];
+    if (S.Function == Fn && !LocBefore(Line, Col, S.Begin) &&
+        LocBefore(Line, Col, S.End))
+      Best = &S;
+  }
+  return Best ? Best->What : "code";
+}
+
+static FILE *RemarksOut;
+
+/// YAMLQuote - Quote Str as a single-quoted YAML scalar.
+static std::string YAMLQuote(const std::string &Str) {
+  std::string Out = "'";
+  for (unsigned i = 0, e = Str.size(); i != e; ++i) {
+    if (Str[i] == '\'')
+      Out += '\'';
+    Out += Str[i];
+  }
+  return Out + "'";
+}
+
+/// HandleDiagnostic - Print optimization remarks against the source construct
+/// they refer to, and anything else the way LLVM would have.
+static void HandleDiagnostic(const DiagnosticInfo &DI, void *) {
+  const char *Kind;
+  const char *YAMLTag;
+  switch (DI.getKind()) {
+  case DK_OptimizationRemark:
+    Kind = "passed";
+    YAMLTag = "!Passed";
+    break;
+  case DK_OptimizationRemarkMissed:
+    Kind = "missed";
+    YAMLTag = "!Missed";
+    break;
+  case DK_OptimizationRemarkAnalysis:
+    Kind = "analysis";
+    YAMLTag = "!Analysis";
+    break;
+  default: {
+    DiagnosticPrinterRawOStream DP(errs());
+    errs() << (DI.getSeverity() == DS_Error ? "error: " : "warning: ");
+    DI.print(DP);
+    errs() << "\n";
+    if (DI.getSeverity() == DS_Error)
+      exit(1);
+    return;
+  }
+  }
+
+  const DiagnosticInfoOptimizationRemarkBase &R =
+    static_cast<const DiagnosticInfoOptimizationRemarkBase &>(DI);
+  std::string Pass = R.getPassName();
+  std::string Fn = R.getFunction().getName().str();
+  std::string Msg = R.getMsg().str();
+  int Line = R.getDebugLoc().getLine(), Col = R.getDebugLoc().getCol();
+  std::string Site = DescribeRemarkSite(Pass, Fn, Line, Col);
+
+  if (Remarks) {
+    fprintf(stderr, "remark [%s, %s]: in '%s', %s", Pass.c_str(), Kind,
+            Fn.c_str(), Site.c_str());
+    if (Line)
+      fprintf(stderr, " at %d:%d", Line, Col);
+    fprintf(stderr, ": %s\n", Msg.c_str());
+  }
+
+  if (RemarksOut)
+    fprintf(RemarksOut, "--- %s\nPass: %s\nFunction: %s\nNode: %s\n"
+            "Line: %d\nColumn: %d\nMessage: %s\n...\n", YAMLTag,
+            YAMLQuote(Pass).c_str(), YAMLQuote(Fn).c_str(),
+            YAMLQuote(Site).c_str(), Line, Col, YAMLQuote(Msg).c_str());
+}
+
+/// InitRemarks - Route the optimizers' diagnostics through HandleDiagnostic.
+static bool InitRemarks() {
+  if (!RemarksEnabled())
+    return true;
+  if (!RemarksFile.empty()) {
+    RemarksOut = fopen(RemarksFile.c_str(), "w");
+    if (!RemarksOut) {
+      perror(RemarksFile.c_str());
+      return false;
+    }
+  }
+  getGlobalContext().setDiagnosticHandler(HandleDiagnostic, 0);
+  return true;
+}
+
+static void FinishRemarks() {
+  if (RemarksOut)
+    fclose(RemarksOut);
+  RemarksOut = 0;
+}
+
+/// FoldedBodies - Maps the profile of every compiled definition to its
+/// function, so that identical definitions can share one body.
+static std::map<std::string, Function*> FoldedBodies;
+
+/// FunctionAliases - Definitions that were folded into an identical earlier
+/// definition, mapped to the name of the function that implements them.
+static std::map<std::string, std::string> FunctionAliases;
+
+/// LookupFunction - Find the function that implements Name, following folded
+/// definitions to the body they share.
+static Function *LookupFunction(const std::string &Name) {
+  std::map<std::string, std::string>::const_iterator I =
+    FunctionAliases.find(Name);
+  if (I != FunctionAliases.end())
+    return TheModule->getFunction(I->second);
+  return TheModule->getFunction(Name);
+}
+
+/// ColdCallsEmitted - The number of calls to 'cold' functions emitted so far.
+/// IfExprAST uses it to tell whether one of its arms is a rarely taken path.
+static unsigned ColdCallsEmitted;
+
+/// CreateCallTo - Emit a call to F that uses F's calling convention, which is
+/// fastcc for internal definitions and the C convention for everything else.
+static CallInst *CreateCallTo(Function *F, ArrayRef<Value*> Args,
+                              const Twine &Name = "") {
+  CallInst *CI = Builder.CreateCall(F, Args, Name);
+  CI->setCallingConv(F->getCallingConv());
+  if (F->hasFnAttribute(Attribute::Cold))
+    ++ColdCallsEmitted;
+  return CI;
+}
+
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
 static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
@@ -640,11 +1697,11 @@ Value *UnaryExprAST::Codegen() {
   Value *OperandV = Operand->Codegen();
   if (OperandV == 0) return 0;
   
-  Function *F = TheModule->getFunction(std::string("unary")+Opcode);
+  Function *F = LookupFunction(std::string("unary")+Opcode);
   if (F == 0)
     return ErrorV("Unknown unary operator");
   
-  return Builder.CreateCall(F, OperandV, "unop");
+  return CreateCallTo(F, OperandV, "unop");
 }
 
 Value *BinaryExprAST::Codegen() {
@@ -684,16 +1741,118 @@ Value *BinaryExprAST::Codegen() {
   
   // If it wasn't a builtin binary operator, it must be a user defined one. Emit
   // a call to it.
-  Function *F = TheModule->getFunction(std::string("binary")+Op);
+  Function *F = LookupFunction(std::string("binary")+Op);
   assert(F && "binary operator not found!");
   
   Value *Ops[] = { L, R };
-  return Builder.CreateCall(F, Ops, "binop");
+  return CreateCallTo(F, Ops, "binop");
+}
+
+/// ConvertFromDouble - Convert a Kaleidoscope double into the C type Ty that a
+/// typed extern expects.  Pointers travel through the language as integral
+/// doubles, which is exact for every address a 64-bit host hands out.
+static Value *ConvertFromDouble(Value *V, Type *Ty) {
+  if (Ty->isDoubleTy())
+    return V;
+  if (Ty->isFloatTy())
+    return Builder.CreateFPTrunc(V, Ty, "ffiarg");
+  if (Ty->isIntegerTy())
+    return Builder.CreateFPToSI(V, Ty, "ffiarg");
+  Type *IntPtrTy = TheModule->getDataLayout()->getIntPtrType(getGlobalContext());
+  return Builder.CreateIntToPtr(Builder.CreateFPToUI(V, IntPtrTy), Ty, "ffiarg");
+}
+
+/// ConvertToDouble - Convert the result of a typed extern back into a double.
+static Value *ConvertToDouble(Value *V) {
+  Type *Ty = V->getType();
+  Type *DoubleTy = Type::getDoubleTy(getGlobalContext());
+  if (Ty->isDoubleTy())
+    return V;
+  if (Ty->isFloatTy())
+    return Builder.CreateFPExt(V, DoubleTy, "ffiret");
+  if (Ty->isIntegerTy())
+    return Builder.CreateSIToFP(V, DoubleTy, "ffiret");
+  Type *IntPtrTy = TheModule->getDataLayout()->getIntPtrType(getGlobalContext());
+  return Builder.CreateUIToFP(Builder.CreatePtrToInt(V, IntPtrTy), DoubleTy,
+                              "ffiret");
+}
+
+/// MaxMappedArrays - The number of array handles available to programs.  The
+/// table has one extra, always empty, entry that invalid handles are clamped
+/// to, so that generated code never reads outside it.
+static const unsigned MaxMappedArrays = 64;
+
+/// GetMappedArrayTable - Return the declaration of the runtime's array table,
+/// an array of { double *Data, i64 Length } entries named toy_mapped_arrays.
+static GlobalVariable *GetMappedArrayTable() {
+  if (GlobalVariable *GV = TheModule->getNamedGlobal("toy_mapped_arrays"))
+    return GV;
+  LLVMContext &C = getGlobalContext();
+  StructType *EntryTy = StructType::get(Type::getDoublePtrTy(C),
+                                        Type::getInt64Ty(C), NULL);
+  ArrayType *TableTy = ArrayType::get(EntryTy, MaxMappedArrays + 1);
+  return new GlobalVariable(*TheModule, TableTy, /*isConstant=*/false,
+                            GlobalValue::ExternalLinkage, 0,
+                            "toy_mapped_arrays");
+}
+
+/// CodegenArrayBuiltin - Emit arraylen(h) or arrayget(h, i) inline.  The
+/// array data stays wherever the runtime mapped it; generated code loads
+/// straight out of it.  Out of range reads produce a NaN instead of faulting.
+static Value *CodegenArrayBuiltin(const std::string &Name,
+                                  const std::vector<Value*> &ArgsV) {
+  LLVMContext &C = getGlobalContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Type *DoubleTy = Type::getDoubleTy(C);
+  Value *Zero = ConstantInt::get(Type::getInt32Ty(C), 0);
+  // Range checks are done on the doubles: fptosi of a NaN or an out of range
+  // value is undef, which would let the optimizer drop an integer check.
+  // Anything above -1 truncates to 0 or more, as in BatchArrayIndex.
+  Value *MinusOne = ConstantFP::get(DoubleTy, -1.0);
+
+  // Clamp bad handles to the empty entry at the end of the table.
+  Value *MaxH = ConstantFP::get(DoubleTy, MaxMappedArrays);
+  Value *HOk = Builder.CreateAnd(Builder.CreateFCmpOGT(ArgsV[0], MinusOne),
+                                 Builder.CreateFCmpOLT(ArgsV[0], MaxH));
+  Value *H = Builder.CreateFPToSI(Builder.CreateSelect(HOk, ArgsV[0], MaxH),
+                                  Int64Ty, "handle");
+  Value *Idx[] = { Zero, H };
+  Value *Entry = Builder.CreateInBoundsGEP(GetMappedArrayTable(), Idx, "entry");
+  Value *Len = Builder.CreateLoad(Builder.CreateConstGEP2_32(Entry, 0, 1),
+                                  "arraylen");
+  if (Name == "arraylen")
+    return Builder.CreateUIToFP(Len, DoubleTy, "arraylen");
+
+  Value *Data = Builder.CreateLoad(Builder.CreateConstGEP2_32(Entry, 0, 0),
+                                   "arraydata");
+  Value *LenD = Builder.CreateUIToFP(Len, DoubleTy);
+  Value *InRange = Builder.CreateAnd(Builder.CreateFCmpOGT(ArgsV[1], MinusOne),
+                                     Builder.CreateFCmpOLT(ArgsV[1], LenD),
+                                     "inrange");
+  Value *I = Builder.CreateSelect(InRange, ArgsV[1],
+                                  ConstantFP::get(DoubleTy, 0.0));
+  I = Builder.CreateFPToSI(I, Int64Ty, "index");
+  Value *Elt = Builder.CreateLoad(Builder.CreateInBoundsGEP(Data, I), "elt");
+  Value *NaN = ConstantFP::getNaN(DoubleTy);
+  return Builder.CreateSelect(InRange, Elt, NaN, "arrayget");
 }
 
 Value *CallExprAST::Codegen() {
   // Look up the name in the global module table.
-  Function *CalleeF = TheModule->getFunction(Callee);
+  Function *CalleeF = LookupFunction(Callee);
+
+  // arraylen(h) and arrayget(h, i) are builtins unless the program defines
+  // functions with those names itself.
+  if (CalleeF == 0 && ((Callee == "arraylen" && Args.size() == 1) ||
+                       (Callee == "arrayget" && Args.size() == 2))) {
+    std::vector<Value*> ArgsV;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+      ArgsV.push_back(Args[i]->Codegen());
+      if (ArgsV.back() == 0) return 0;
+    }
+    return CodegenArrayBuiltin(Callee, ArgsV);
+  }
+
   if (CalleeF == 0)
     return ErrorV("Unknown function referenced");
   
@@ -701,15 +1860,32 @@ Value *CallExprAST::Codegen() {
   if (CalleeF->arg_size() != Args.size())
     return ErrorV("Incorrect # arguments passed");
 
+  // Typed externs take C types directly, so convert each argument here rather
+  // than going through a double-only shim.
+  FunctionType *FT = CalleeF->getFunctionType();
   std::vector<Value*> ArgsV;
   for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->Codegen());
-    if (ArgsV.back() == 0) return 0;
+    Value *ArgV = Args[i]->Codegen();
+    if (ArgV == 0) return 0;
+    ArgsV.push_back(ConvertFromDouble(ArgV, FT->getParamType(i)));
+  }
+
+  SetDebugLoc(Loc);
+  if (RemarksEnabled())
+    AddRemarkSite(CallSites, Loc, Loc, "call to '" + Callee + "'");
+
+  if (FT->getReturnType()->isVoidTy()) {
+    CreateCallTo(CalleeF, ArgsV);
+    return ConstantFP::get(getGlobalContext(), APFloat(0.0));
   }
   
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  return ConvertToDouble(CreateCallTo(CalleeF, ArgsV, "calltmp"));
 }
 
+/// HotBranchWeight - The weight given to the likely side of a branch whose
+/// other side has weight 1.
+static const unsigned HotBranchWeight = 2000;
+
 Value *IfExprAST::Codegen() {
   Value *CondV = Cond->Codegen();
   if (CondV == 0) return 0;
@@ -727,13 +1903,15 @@ Value *IfExprAST::Codegen() {
   BasicBlock *ElseBB = BasicBlock::Create(getGlobalContext(), "else");
   BasicBlock *MergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
   
-  Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  BranchInst *Br = Builder.CreateCondBr(CondV, ThenBB, ElseBB);
   
   // Emit then value.
   Builder.SetInsertPoint(ThenBB);
   
+  unsigned ColdCallsBefore = ColdCallsEmitted;
   Value *ThenV = Then->Codegen();
   if (ThenV == 0) return 0;
+  bool ThenCold = ColdCallsEmitted != ColdCallsBefore;
   
   Builder.CreateBr(MergeBB);
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
@@ -743,8 +1921,20 @@ Value *IfExprAST::Codegen() {
   TheFunction->getBasicBlockList().push_back(ElseBB);
   Builder.SetInsertPoint(ElseBB);
   
+  ColdCallsBefore = ColdCallsEmitted;
   Value *ElseV = Else->Codegen();
   if (ElseV == 0) return 0;
+  bool ElseCold = ColdCallsEmitted != ColdCallsBefore;
+
+  // An arm that calls a cold function is assumed to be rarely taken.  Weight
+  // the branch so the backend lays that arm out of line, and so that
+  // SplitColdRegions can move it out of the function entirely.
+  if (ThenCold != ElseCold) {
+    MDBuilder MDB(getGlobalContext());
+    Br->setMetadata(LLVMContext::MD_prof,
+                    ThenCold ? MDB.createBranchWeights(1, HotBranchWeight)
+                             : MDB.createBranchWeights(HotBranchWeight, 1));
+  }
   
   Builder.CreateBr(MergeBB);
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
@@ -784,6 +1974,11 @@ Value *ForExprAST::Codegen() {
   
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
+  ++LoopsEmitted;
+  SetDebugLoc(Loc);
+  if (RemarksEnabled())
+    AddRemarkSite(LoopSites, Loc, EndLoc, "for loop over '" + VarName + "'");
+
   // Create an alloca for the variable in the entry block.
   AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
   
@@ -828,6 +2023,9 @@ Value *ForExprAST::Codegen() {
   // Compute the end condition.
   Value *EndCond = End->Codegen();
   if (EndCond == 0) return EndCond;
+
+  // Calls in the body moved the location; the latch belongs to the loop.
+  SetDebugLoc(Loc);
   
   // Reload, increment, and restore the alloca.  This handles the case where
   // the body of the loop mutates the variable.
@@ -906,12 +2104,33 @@ Value *VarExprAST::Codegen() {
   return BodyVal;
 }
 
+/// getFFIType - Return the LLVM type used for an extern argument or result.
+static Type *getFFIType(FFIType Ty) {
+  LLVMContext &C = getGlobalContext();
+  switch (Ty) {
+  case ffi_f64:  return Type::getDoubleTy(C);
+  case ffi_f32:  return Type::getFloatTy(C);
+  case ffi_i32:  return Type::getInt32Ty(C);
+  case ffi_i64:  return Type::getInt64Ty(C);
+  case ffi_ptr:  return Type::getInt8PtrTy(C);
+  case ffi_void: return Type::getVoidTy(C);
+  }
+  llvm_unreachable("unknown FFI type");
+}
+
 Function *PrototypeAST::Codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type*> Doubles(Args.size(), 
-                             Type::getDoubleTy(getGlobalContext()));
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(getGlobalContext()),
-                                       Doubles, false);
+  // Make the function type:  double(double,double) etc.  Typed externs use
+  // their declared C types instead.
+  std::vector<Type*> ArgTys;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    ArgTys.push_back(getFFIType(ArgTypes.empty() ? ffi_f64 : ArgTypes[i]));
+  FunctionType *FT = FunctionType::get(getFFIType(RetType), ArgTys, false);
+
+  // A definition folded into another one still owns its name.
+  if (FunctionAliases.count(Name)) {
+    ErrorF("redefinition of function");
+    return 0;
+  }
   
   Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule);
   
@@ -933,8 +2152,22 @@ Function *PrototypeAST::Codegen() {
       ErrorF("redefinition of function with different # args");
       return 0;
     }
+
+    // If F was declared with different argument or result types, reject.
+    if (F->getFunctionType() != FT) {
+      ErrorF("redefinition of function with different types");
+      return 0;
+    }
   }
   
+  // Keep cold functions small and out of their callers, so calling them
+  // doesn't drag rarely executed code into hot paths.
+  if (Cold) {
+    F->addFnAttr(Attribute::Cold);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::OptimizeForSize);
+  }
+
   // Set names for all arguments.
   unsigned Idx = 0;
   for (Function::arg_iterator AI = F->arg_begin(); Idx != Args.size();
@@ -960,12 +2193,817 @@ void PrototypeAST::CreateArgumentAllocas(Function *F) {
   }
 }
 
+static cl::opt<bool>
+SplitCold("split-cold", cl::init(true),
+          cl::desc("Move rarely taken branch arms into separate cold "
+                   "functions"));
+
+/// MinColdRegionSize - Cold regions smaller than this many instructions are
+/// left in place; the call would cost about as much as the code it saves.
+static const unsigned MinColdRegionSize = 4;
+
+/// SplitColdRegions - Outline the cold side of every strongly biased branch in
+/// F into its own cold function.  The hot path then stays dense in the
+/// instruction cache and only pays for a call when the rare arm runs.
+static void SplitColdRegions(Function &F) {
+  DominatorTree DT;
+  DT.recalculate(F);
+
+  // Find the entry block of every cold region.
+  std::vector<BasicBlock*> Entries;
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    BranchInst *BI = dyn_cast<BranchInst>(BB->getTerminator());
+    if (!BI || !BI->isConditional())
+      continue;
+    MDNode *Weights = BI->getMetadata(LLVMContext::MD_prof);
+    if (!Weights || Weights->getNumOperands() != 3)
+      continue;
+    ConstantInt *TW = dyn_cast<ConstantInt>(Weights->getOperand(1));
+    ConstantInt *FW = dyn_cast<ConstantInt>(Weights->getOperand(2));
+    if (!TW || !FW)
+      continue;
+
+    BasicBlock *Cold;
+    if (TW->getZExtValue() * 100 <= FW->getZExtValue())
+      Cold = BI->getSuccessor(0);
+    else if (FW->getZExtValue() * 100 <= TW->getZExtValue())
+      Cold = BI->getSuccessor(1);
+    else
+      continue;
+    if (Cold->getSinglePredecessor() == BB)
+      Entries.push_back(Cold);
+  }
+
+  // Nested cold regions move along with the outermost one.
+  std::vector<std::vector<BasicBlock*> > Regions;
+  for (unsigned i = 0, e = Entries.size(); i != e; ++i) {
+    bool Nested = false;
+    for (unsigned j = 0; j != e && !Nested; ++j)
+      Nested = j != i && DT.dominates(Entries[j], Entries[i]);
+    if (Nested)
+      continue;
+
+    std::vector<BasicBlock*> Region;
+    unsigned Size = 0;
+    for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB)
+      if (DT.dominates(Entries[i], BB)) {
+        Region.push_back(BB);
+        Size += BB->size();
+      }
+    if (Size >= MinColdRegionSize)
+      Regions.push_back(Region);
+  }
+
+  for (unsigned i = 0, e = Regions.size(); i != e; ++i) {
+    CodeExtractor CE(Regions[i]);
+    if (!CE.isEligible())
+      continue;
+    if (Function *Outlined = CE.extractCodeRegion()) {
+      Outlined->addFnAttr(Attribute::Cold);
+      Outlined->addFnAttr(Attribute::NoInline);
+      Outlined->addFnAttr(Attribute::OptimizeForSize);
+    }
+  }
+}
+
+static cl::opt<unsigned>
+CodegenOptLevel("codegen-opt", cl::init(2),
+                cl::desc("Machine code optimization level (0-3), independent "
+                         "of the IR pipeline"));
+
+static cl::opt<bool>
+FastCodegenTopLevel("fast-codegen-toplevel", cl::init(true),
+                    cl::desc("Use fast instruction selection for top-level "
+                             "expressions, which only run once"));
+
+static cl::opt<unsigned>
+FastCodegenBelow("fast-codegen-below", cl::init(0),
+                 cl::desc("Use fast instruction selection for definitions "
+                          "with fewer IR instructions than this"));
+
+/// CountInstructions - Return the number of IR instructions in F.
+static unsigned CountInstructions(const Function &F) {
+  unsigned Count = 0;
+  for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB)
+    Count += BB->size();
+  return Count;
+}
+
+/// SelectCodegenTier - Decide how hard the backend should work on F, which
+/// has already been through the IR pipeline.  Functions that are cheap or
+/// only run once are marked optnone, which makes the JIT select instructions
+/// with FastISel at -O0 for that function alone.  Batch mode leaves every
+/// function alone: optnone would stop definitions being inlined, and would
+/// keep the module passes away from the top-level expressions they are
+/// inlined into.
+static void SelectCodegenTier(Function &F) {
+  if (BatchMode)
+    return;
+
+  bool Fast;
+  if (F.getName().empty())
+    Fast = FastCodegenTopLevel;
+  else
+    Fast = CountInstructions(F) < FastCodegenBelow;
+
+  if (Fast) {
+    F.addFnAttr(Attribute::NoInline);
+    F.addFnAttr(Attribute::OptimizeNone);
+  }
+}
+
+static cl::opt<bool>
+Instrument("instrument",
+           cl::desc("Count calls and cycles in every definition and report "
+                    "the hottest ones at exit"));
+
+namespace {
+/// InstrStats - -instrument's counters for one definition.  Generated code
+/// refers to its entry by address.
+struct InstrStats {
+  std::string Name;
+  std::atomic<uint64_t> Calls, TotalCycles, SelfCycles;
+  InstrStats() : Calls(0), TotalCycles(0), SelfCycles(0) {}
+};
+
+/// InstrFrame - What the exit half of the bookkeeping needs from the entry.
+struct InstrFrame {
+  Value *Stats, *Saved, *Start;
+};
+} // end anonymous namespace
+
+/// InstrTable - One entry per instrumented definition.  A deque, so entries
+/// never move once generated code points at them.
+static std::deque<InstrStats> InstrTable;
+
+/// EmitInstrEntry - Emit a call to the runtime that counts a call to F and
+/// starts timing it.  Self time is found by having each frame collect the
+/// cycles spent in its instrumented callees, so the runtime swaps that
+/// accumulator out on entry and back in on exit.
+static InstrFrame EmitInstrEntry(Function *F) {
+  InstrTable.emplace_back();
+  InstrStats &S = InstrTable.back();
+  S.Name = F->getName().empty() ? "<top-level>" : F->getName().str();
+
+  LLVMContext &C = getGlobalContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+  Constant *Enter = TheModule->getOrInsertFunction("toy_instr_enter", Int64Ty,
+                                                   Int8PtrTy, NULL);
+  InstrFrame Frame = InstrFrame();
+  Frame.Stats = ConstantExpr::getIntToPtr(
+                  ConstantInt::get(Int64Ty, (uint64_t)(uintptr_t)&S),
+                  Int8PtrTy);
+  Frame.Saved = Builder.CreateCall(Enter, Frame.Stats, "instr.saved");
+  Frame.Start = Builder.CreateCall(
+                  Intrinsic::getDeclaration(TheModule,
+                                            Intrinsic::readcyclecounter),
+                  "instr.start");
+  return Frame;
+}
+
+/// EmitInstrExit - Emit the call that finishes timing a frame of F.
+static void EmitInstrExit(const InstrFrame &Frame) {
+  LLVMContext &C = getGlobalContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Constant *Exit = TheModule->getOrInsertFunction("toy_instr_exit",
+                                                  Type::getVoidTy(C),
+                                                  Type::getInt8PtrTy(C),
+                                                  Int64Ty, Int64Ty, Int64Ty,
+                                                  NULL);
+  Value *End = Builder.CreateCall(
+                 Intrinsic::getDeclaration(TheModule,
+                                           Intrinsic::readcyclecounter),
+                 "instr.end");
+  Builder.CreateCall4(Exit, Frame.Stats, Frame.Start, End, Frame.Saved);
+}
+
+/// MoreSelfCycles - Order by self time, hottest first.
+static bool MoreSelfCycles(const InstrStats *A, const InstrStats *B) {
+  return A->SelfCycles > B->SelfCycles;
+}
+
+/// ReportInstrumentation - Print the instrumented definitions that ran,
+/// hottest by self time first.  Total time counts each recursive frame, so
+/// it overstates recursive functions; self time doesn't.
+static void ReportInstrumentation() {
+  std::vector<const InstrStats*> Ran;
+  uint64_t AllSelf = 0;
+  for (unsigned i = 0, e = InstrTable.size(); i != e; ++i)
+    if (InstrTable[i].Calls) {
+      Ran.push_back(&InstrTable[i]);
+      AllSelf += InstrTable[i].SelfCycles;
+    }
+  if (Ran.empty())
+    return;
+  std::stable_sort(Ran.begin(), Ran.end(), MoreSelfCycles);
+
+  fprintf(stderr, "%-24s %12s %16s %7s %16s %12s\n", "function", "calls",
+          "self cycles", "self %", "total cycles", "cycles/call");
+  for (unsigned i = 0, e = Ran.size(); i != e; ++i) {
+    const InstrStats &S = *Ran[i];
+    fprintf(stderr, "%-24s %12llu %16llu %6.2f%% %16llu %12llu\n",
+            S.Name.c_str(), (unsigned long long)S.Calls,
+            (unsigned long long)S.SelfCycles,
+            AllSelf ? 100.0 * S.SelfCycles / AllSelf : 0.0,
+            (unsigned long long)S.TotalCycles,
+            (unsigned long long)(S.TotalCycles / S.Calls));
+  }
+}
+
+static cl::opt<bool>
+PassStats("pass-stats",
+          cl::desc("Time each pass of the per-function pipeline and count "
+                   "the instructions it leaves behind; report at exit or "
+                   "when the program calls passstats()"));
+
+static cl::opt<bool>
+PassStatsFunctions("pass-stats-functions",
+                   cl::desc("With -pass-stats, also report every function "
+                            "as soon as its pipeline has run"));
+
+/// PassStat - What one pass of the pipeline cost and did, summed over runs.
+struct PassStat {
+  uint64_t Runs;
+  uint64_t Ns;
+  uint64_t InstsBefore, InstsAfter;
+  PassStat() : Runs(0), Ns(0), InstsBefore(0), InstsAfter(0) {}
+  void add(uint64_t ns, unsigned Before, unsigned After) {
+    ++Runs;
+    Ns += ns;
+    InstsBefore += Before;
+    InstsAfter += After;
+  }
+};
+
+/// TimedPassNames - The pipeline passes being measured, in pipeline order.
+static std::vector<std::string> TimedPassNames;
+
+/// SessionPassStats - Per pass totals over every function compiled so far,
+/// indexed like TimedPassNames.  FunctionPassStats keeps the same numbers
+/// per named function; top-level expressions all have the empty name, so
+/// they only count towards the session.
+static std::vector<PassStat> SessionPassStats;
+static std::map<std::string, std::vector<PassStat> > FunctionPassStats;
+
+static const unsigned NoTimedPass = ~0U;
+
+/// LastTimedPass - The most recently added timed pass of the pipeline being
+/// built, which the next probe measures.
+static unsigned LastTimedPass = NoTimedPass;
+
+namespace {
+/// PassProbe - Sits between two passes of a pipeline and charges the time
+/// and size change since the previous probe to timed pass Prev, if there is
+/// one.  Anything the measured pass required is charged to it too, which is
+/// what we want when deciding what to keep.
+class PassProbe : public FunctionPass {
+  unsigned Prev;
+  static uint64_t StartNs;
+  static unsigned StartInsts;
+public:
+  static char ID;
+  explicit PassProbe(unsigned prev) : FunctionPass(ID), Prev(prev) {}
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesAll();
+  }
+
+  virtual bool runOnFunction(Function &F) {
+    uint64_t Now = MetricNow();
+    unsigned Insts = CountInstructions(F);
+    if (Prev != NoTimedPass) {
+      uint64_t Ns = Now - StartNs;
+      SessionPassStats[Prev].add(Ns, StartInsts, Insts);
+      if (!F.getName().empty()) {
+        std::vector<PassStat> &FS = FunctionPassStats[F.getName().str()];
+        FS.resize(TimedPassNames.size());
+        FS[Prev].add(Ns, StartInsts, Insts);
+      }
+    }
+    StartInsts = Insts;
+    // Leave the counting out of the next pass's time.
+    StartNs = MetricNow();
+    return false;
+  }
+};
+} // end anonymous namespace
+
+char PassProbe::ID = 0;
+uint64_t PassProbe::StartNs = 0;
+unsigned PassProbe::StartInsts = 0;
+
+/// AddTimedPass - Add P to the pipeline, measured if -pass-stats is on.
+/// Prefix distinguishes the same pass in different pipelines.
+static void AddTimedPass(FunctionPassManager &FPM, Pass *P,
+                         const std::string &Prefix = "") {
+  if (PassStats) {
+    FPM.add(new PassProbe(LastTimedPass));
+    LastTimedPass = TimedPassNames.size();
+    TimedPassNames.push_back(Prefix + std::string(P->getPassName()));
+    SessionPassStats.resize(TimedPassNames.size());
+  }
+  FPM.add(P);
+}
+
+/// FinishTimedPasses - Close the measurement of the last timed pass.
+static void FinishTimedPasses(FunctionPassManager &FPM) {
+  if (LastTimedPass != NoTimedPass)
+    FPM.add(new PassProbe(LastTimedPass));
+  LastTimedPass = NoTimedPass;
+}
+
+static void PrintPassStats(const std::vector<PassStat> &Stats) {
+  uint64_t AllNs = 0;
+  for (unsigned i = 0, e = Stats.size(); i != e; ++i)
+    AllNs += Stats[i].Ns;
+
+  fprintf(stderr, "  %-36s %8s %12s %7s %12s %12s\n", "pass", "runs",
+          "time (ms)", "time %", "insts in", "insts out");
+  for (unsigned i = 0, e = Stats.size(); i != e; ++i) {
+    const PassStat &S = Stats[i];
+    if (!S.Runs)
+      continue;
+    fprintf(stderr, "  %-36s %8llu %12.3f %6.2f%% %12llu %12llu\n",
+            TimedPassNames[i].c_str(), (unsigned long long)S.Runs,
+            S.Ns / 1e6, AllNs ? 100.0 * S.Ns / AllNs : 0.0,
+            (unsigned long long)S.InstsBefore,
+            (unsigned long long)S.InstsAfter);
+  }
+  fprintf(stderr, "  %-36s %8s %12.3f\n", "total", "", AllNs / 1e6);
+}
+
+/// ReportFunctionPassStats - Print what the pipeline did to function Name.
+static void ReportFunctionPassStats(const std::string &Name) {
+  std::map<std::string, std::vector<PassStat> >::const_iterator I =
+    FunctionPassStats.find(Name);
+  if (I == FunctionPassStats.end())
+    return;
+  fprintf(stderr, "pass stats for '%s':\n", Name.c_str());
+  PrintPassStats(I->second);
+}
+
+/// ReportPassStats - Print the session totals per pass, then the functions
+/// that took longest to optimize with the pass that cost them most.
+static void ReportPassStats() {
+  if (!PassStats || TimedPassNames.empty())
+    return;
+  fprintf(stderr, "pass stats for the session:\n");
+  PrintPassStats(SessionPassStats);
+
+  std::vector<std::pair<uint64_t, std::string> > ByTime;
+  std::map<std::string, std::vector<PassStat> >::const_iterator I, E;
+  for (I = FunctionPassStats.begin(), E = FunctionPassStats.end(); I != E;
+       ++I) {
+    uint64_t Ns = 0;
+    for (unsigned i = 0, e = I->second.size(); i != e; ++i)
+      Ns += I->second[i].Ns;
+    ByTime.push_back(std::make_pair(Ns, I->first));
+  }
+  std::sort(ByTime.rbegin(), ByTime.rend());
+
+  const unsigned MaxFunctions = 20;
+  fprintf(stderr, "  %-24s %12s %12s %12s  %s\n", "function", "time (ms)",
+          "insts in", "insts out", "slowest pass");
+  for (unsigned i = 0, e = std::min<size_t>(ByTime.size(), MaxFunctions);
+       i != e; ++i) {
+    const std::vector<PassStat> &FS = FunctionPassStats[ByTime[i].second];
+    unsigned Slowest = 0, First = NoTimedPass, Last = 0;
+    for (unsigned p = 0, pe = FS.size(); p != pe; ++p) {
+      if (!FS[p].Runs)
+        continue;
+      if (First == NoTimedPass)
+        First = p;
+      Last = p;
+      if (FS[p].Ns > FS[Slowest].Ns)
+        Slowest = p;
+    }
+    fprintf(stderr, "  %-24s %12.3f %12llu %12llu  %s\n",
+            ByTime[i].second.c_str(), ByTime[i].first / 1e6,
+            (unsigned long long)FS[First].InstsBefore,
+            (unsigned long long)FS[Last].InstsAfter,
+            TimedPassNames[Slowest].c_str());
+  }
+}
+
+/// passstats - Print the pass statistics gathered so far.
+extern "C"
+double passstats() {
+  ReportPassStats();
+  return 0;
+}
+
+static cl::opt<bool>
+AdaptiveOpt("adaptive-opt",
+            cl::desc("Pick each definition's IR pipeline from its size, its "
+                     "loops and, with -instrument, how often it is called"));
+
+static cl::opt<unsigned>
+LightOptBelow("light-opt-below", cl::init(40),
+              cl::desc("With -adaptive-opt, only promote and combine in "
+                       "loop-free definitions with fewer IR instructions "
+                       "than this"));
+
+static cl::opt<unsigned>
+AggressiveOptAbove("aggressive-opt-above", cl::init(200),
+                   cl::desc("With -adaptive-opt, unroll and vectorize "
+                            "definitions with loops and at least this many "
+                            "IR instructions"));
+
+static cl::opt<unsigned>
+TierUpCalls("tier-up-calls", cl::init(10000),
+            cl::desc("With -adaptive-opt and -instrument, recompile a "
+                     "definition with the aggressive pipeline once it has "
+                     "been called this many times"));
+
+/// OptTier - The IR pipelines -adaptive-opt chooses between.  Without it,
+/// everything gets tier_full.
+enum OptTier {
+  tier_none,        // Run once; not worth optimizing.
+  tier_light,       // mem2reg and instcombine.
+  tier_full,        // The standard pipeline.
+  tier_aggressive,  // The standard pipeline, then loop opts and vectorization.
+  NumOptTiers
+};
+
+static const char *const OptTierNames[NumOptTiers] = {
+  "none", "light", "full", "aggressive"
+};
+
+/// TierPipelines - The pass manager for each tier, set up in main.  There is
+/// none for tier_none.
+static FunctionPassManager *TierPipelines[NumOptTiers];
+
+namespace {
+/// TieredFunction - What tier-up needs to know about a definition.
+struct TieredFunction {
+  OptTier Tier;
+  const InstrStats *Stats;
+};
+} // end anonymous namespace
+
+static std::map<Function*, TieredFunction> TieredFunctions;
+
+static cl::opt<std::string>
+PipelineSpec("pipeline", cl::init(""), cl::value_desc("passes"),
+             cl::desc("Replace the standard per-function pipeline with a "
+                      "comma separated list of passes, e.g. "
+                      "'mem2reg,instcombine,gvn,loop-rotate,unroll(4)'; "
+                      "not with -adaptive-opt"));
+
+static cl::opt<std::string>
+PipelineConfig("pipeline-config", cl::init(""), cl::value_desc("file"),
+               cl::desc("Load a pipeline configuration, such as one written "
+                        "by -autotune-out; not with -adaptive-opt"));
+
+/// PipelinePassKind - The passes a pipeline spec can name.
+enum PipelinePassKind {
+  pp_mem2reg, pp_instcombine, pp_reassociate, pp_gvn, pp_simplifycfg,
+  pp_early_cse, pp_sccp, pp_dse, pp_loop_rotate, pp_licm, pp_indvars,
+  pp_unroll, pp_vectorize, pp_slp, NumPipelinePasses
+};
+
+static const char *const PipelinePassNames[NumPipelinePasses] = {
+  "mem2reg", "instcombine", "reassociate", "gvn", "simplifycfg", "early-cse",
+  "sccp", "dse", "loop-rotate", "licm", "indvars", "unroll", "vectorize", "slp"
+};
+
+namespace {
+/// PipelineStep - One pass of a pipeline spec.  Only unroll takes a
+/// parameter, its count; 0 lets the pass choose.
+struct PipelineStep {
+  PipelinePassKind Kind;
+  int Param;
+};
+
+/// PipelineSettings - Everything a pipeline configuration controls.
+struct PipelineSettings {
+  std::vector<PipelineStep> Steps;  // Empty for the standard pipeline.
+  int InlineThreshold;              // -1 for LLVM's default.
+  unsigned VectorWidth;             // 0 lets the vectorizer choose.
+  PipelineSettings() : InlineThreshold(-1), VectorWidth(0) {}
+};
+} // end anonymous namespace
+
+/// ActivePipeline - The configuration from -pipeline-config and -pipeline.
+static PipelineSettings ActivePipeline;
+
+static Pass *CreatePipelinePass(const PipelineStep &S) {
+  switch (S.Kind) {
+  case pp_mem2reg:     return createPromoteMemoryToRegisterPass();
+  case pp_instcombine: return createInstructionCombiningPass();
+  case pp_reassociate: return createReassociatePass();
+  case pp_gvn:         return createGVNPass();
+  case pp_simplifycfg: return createCFGSimplificationPass();
+  case pp_early_cse:   return createEarlyCSEPass();
+  case pp_sccp:        return createSCCPPass();
+  case pp_dse:         return createDeadStoreEliminationPass();
+  case pp_loop_rotate: return createLoopRotatePass();
+  case pp_licm:        return createLICMPass();
+  case pp_indvars:     return createIndVarSimplifyPass();
+  case pp_unroll:      return createLoopUnrollPass(-1, S.Param ? S.Param : -1);
+  case pp_vectorize:   return createLoopVectorizePass();
+  case pp_slp:         return createSLPVectorizerPass();
+  case NumPipelinePasses: break;
+  }
+  llvm_unreachable("unknown pipeline pass");
+}
+
+/// ParsePipelineSpec - Parse a spec like "mem2reg,gvn,unroll(4)" into Steps.
+/// On failure, return false and describe the problem in Err.
+static bool ParsePipelineSpec(const std::string &Spec,
+                              std::vector<PipelineStep> &Steps,
+                              std::string &Err) {
+  Steps.clear();
+  size_t Pos = 0;
+  while (Pos < Spec.size()) {
+    size_t Comma = Spec.find(',', Pos);
+    if (Comma == std::string::npos)
+      Comma = Spec.size();
+    std::string Item = Spec.substr(Pos, Comma - Pos);
+    Pos = Comma + 1;
+
+    PipelineStep S;
+    S.Param = 0;
+    size_t Paren = Item.find('(');
+    std::string Name = Item.substr(0, Paren);
+    unsigned K = 0;
+    while (K != NumPipelinePasses && Name != PipelinePassNames[K])
+      ++K;
+    if (K == NumPipelinePasses) {
+      Err = "unknown pass '" + Name + "'";
+      return false;
+    }
+    S.Kind = (PipelinePassKind)K;
+    if (Paren != std::string::npos) {
+      char *End;
+      S.Param = strtol(Item.c_str() + Paren + 1, &End, 10);
+      if (S.Kind != pp_unroll || S.Param < 0 || strcmp(End, ")") != 0) {
+        Err = "bad parameter in '" + Item + "'";
+        return false;
+      }
+    }
+    Steps.push_back(S);
+  }
+  if (Steps.empty()) {
+    Err = "empty pipeline";
+    return false;
+  }
+  return true;
+}
+
+static std::string FormatPipelineSpec(const std::vector<PipelineStep> &Steps) {
+  std::string Spec;
+  for (unsigned i = 0, e = Steps.size(); i != e; ++i) {
+    if (i)
+      Spec += ',';
+    Spec += PipelinePassNames[Steps[i].Kind];
+    if (Steps[i].Param) {
+      char Buf[16];
+      snprintf(Buf, sizeof(Buf), "(%d)", Steps[i].Param);
+      Spec += Buf;
+    }
+  }
+  return Spec;
+}
+
+/// LoadPipelineConfig - Read a configuration file of 'key = value' lines.
+/// Blank lines and lines starting with '#' are ignored.
+static bool LoadPipelineConfig(const std::string &Path, PipelineSettings &S) {
+  FILE *F = fopen(Path.c_str(), "r");
+  if (!F) {
+    perror(Path.c_str());
+    return false;
+  }
+  char Line[4096];
+  unsigned LineNo = 0;
+  bool Ok = true;
+  while (Ok && fgets(Line, sizeof(Line), F)) {
+    ++LineNo;
+    std::string L(Line);
+    L.erase(std::remove_if(L.begin(), L.end(), ::isspace), L.end());
+    if (L.empty() || L[0] == '#')
+      continue;
+    size_t Eq = L.find('=');
+    std::string Key = L.substr(0, Eq), Value, Err;
+    if (Eq != std::string::npos)
+      Value = L.substr(Eq + 1);
+    if (Key == "pipeline")
+      Ok = ParsePipelineSpec(Value, S.Steps, Err);
+    else if (Key == "inline-threshold")
+      S.InlineThreshold = atoi(Value.c_str());
+    else if (Key == "vector-width")
+      S.VectorWidth = atoi(Value.c_str());
+    else {
+      Err = "unknown setting '" + Key + "'";
+      Ok = false;
+    }
+    if (!Ok)
+      fprintf(stderr, "%s:%u: %s\n", Path.c_str(), LineNo, Err.c_str());
+  }
+  fclose(F);
+  return Ok;
+}
+
+/// WritePipelineConfig - Write S in the format LoadPipelineConfig reads.
+static bool WritePipelineConfig(const std::string &Path,
+                                const PipelineSettings &S,
+                                const char *Comment = 0) {
+  FILE *F = fopen(Path.c_str(), "w");
+  if (!F) {
+    perror(Path.c_str());
+    return false;
+  }
+  fprintf(F, "# Pass pipeline configuration for -pipeline-config.\n");
+  if (Comment)
+    fprintf(F, "# %s\n", Comment);
+  if (!S.Steps.empty())
+    fprintf(F, "pipeline = %s\n", FormatPipelineSpec(S.Steps).c_str());
+  fprintf(F, "inline-threshold = %d\nvector-width = %u\n", S.InlineThreshold,
+          S.VectorWidth);
+  return fclose(F) == 0;
+}
+
+/// InitPipelineSettings - Load -pipeline-config, let -pipeline override its
+/// pass list, and pass the vector width on to the vectorizer.
+static bool InitPipelineSettings() {
+  // A configured pipeline replaces only the full tier.  The other tiers and
+  // tier-up would quietly ignore it, so tuning would tune almost nothing.
+  if (AdaptiveOpt && (!PipelineConfig.empty() || !PipelineSpec.empty())) {
+    fprintf(stderr, "-pipeline and -pipeline-config can't be combined with "
+                    "-adaptive-opt\n");
+    return false;
+  }
+  if (!PipelineConfig.empty() &&
+      !LoadPipelineConfig(PipelineConfig, ActivePipeline))
+    return false;
+  if (!PipelineSpec.empty()) {
+    std::string Err;
+    if (!ParsePipelineSpec(PipelineSpec, ActivePipeline.Steps, Err)) {
+      fprintf(stderr, "-pipeline: %s\n", Err.c_str());
+      return false;
+    }
+  }
+  if (ActivePipeline.VectorWidth) {
+    // The vectorizer only takes a forced width through its own option.
+    StringMap<cl::Option*> Opts;
+    cl::getRegisteredOptions(Opts);
+    StringMap<cl::Option*>::iterator I = Opts.find("force-vector-width");
+    char Width[16];
+    snprintf(Width, sizeof(Width), "%u", ActivePipeline.VectorWidth);
+    if (I != Opts.end())
+      I->second->addOccurrence(0, I->first(), Width);
+  }
+  return true;
+}
+
+/// AddOptPipeline - Fill FPM with the passes of Tier.  The loop vectorizer
+/// uses TM's cost model if there is one.
+static void AddOptPipeline(FunctionPassManager &FPM, OptTier Tier,
+                           TargetMachine *TM) {
+  std::string Prefix = AdaptiveOpt ? OptTierNames[Tier] + std::string(": ")
+                                   : "";
+  bool Custom = Tier == tier_full && !ActivePipeline.Steps.empty();
+  bool Loops = Tier == tier_aggressive || (Tier == tier_full && LoopOpts);
+
+  // Register info about how the target lays out data structures.
+  FPM.add(new DataLayoutPass(TheModule));
+  // Provide basic AliasAnalysis support for GVN.
+  FPM.add(createBasicAliasAnalysisPass());
+  if ((Loops || Custom) && TM)
+    TM->addAnalysisPasses(FPM);
+
+  // A configured pipeline replaces the standard one.
+  if (Custom) {
+    for (unsigned i = 0, e = ActivePipeline.Steps.size(); i != e; ++i)
+      AddTimedPass(FPM, CreatePipelinePass(ActivePipeline.Steps[i]), Prefix);
+    FinishTimedPasses(FPM);
+    FPM.doInitialization();
+    return;
+  }
+
+  // Promote allocas to registers.
+  AddTimedPass(FPM, createPromoteMemoryToRegisterPass(), Prefix);
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  AddTimedPass(FPM, createInstructionCombiningPass(), Prefix);
+  if (Tier != tier_light) {
+    // Reassociate expressions.
+    AddTimedPass(FPM, createReassociatePass(), Prefix);
+    // Eliminate Common SubExpressions.
+    AddTimedPass(FPM, createGVNPass(), Prefix);
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    AddTimedPass(FPM, createCFGSimplificationPass(), Prefix);
+  }
+  if (Loops) {
+    AddTimedPass(FPM, createLoopRotatePass(), Prefix);
+    AddTimedPass(FPM, createLICMPass(), Prefix);
+    AddTimedPass(FPM, createIndVarSimplifyPass(), Prefix);
+    if (Tier == tier_aggressive)
+      AddTimedPass(FPM, createLoopUnrollPass(), Prefix);
+    AddTimedPass(FPM, createLoopVectorizePass(), Prefix);
+    if (Tier == tier_aggressive)
+      AddTimedPass(FPM, createSLPVectorizerPass(), Prefix);
+    AddTimedPass(FPM, createInstructionCombiningPass(), Prefix);
+    AddTimedPass(FPM, createCFGSimplificationPass(), Prefix);
+  }
+  FinishTimedPasses(FPM);
+  FPM.doInitialization();
+}
+
+/// SelectOptTier - Decide which pipeline F, freshly generated, should get.
+/// The unoptimized IR is a close measure of the size of the AST.
+static OptTier SelectOptTier(const Function &F, bool HasLoops) {
+  if (!AdaptiveOpt)
+    return tier_full;
+  unsigned Size = CountInstructions(F);
+  if (F.getName().empty() && !HasLoops)
+    return tier_none;
+  if (!HasLoops && Size < LightOptBelow)
+    return tier_light;
+  if (HasLoops && Size >= AggressiveOptAbove)
+    return tier_aggressive;
+  return tier_full;
+}
+
+static void RunOptPipeline(Function &F, OptTier Tier) {
+  if (FunctionPassManager *FPM = TierPipelines[Tier])
+    FPM->run(F);
+}
+
+/// NoteOptTier - Remember which tier definition F got, so that it can be
+/// tiered up if -instrument finds it hot.  Batch mode runs module passes that
+/// may merge or delete F, so nothing is tracked there.
+static void NoteOptTier(Function *F, OptTier Tier, const InstrStats *Stats) {
+  if (!AdaptiveOpt || BatchMode || !Stats || F->getName().empty())
+    return;
+  TieredFunction &T = TieredFunctions[F];
+  T.Tier = Tier;
+  T.Stats = Stats;
+}
+
+/// CodegenFolded - Implement this definition with Canonical, an identical
+/// function that has already been compiled.
+Function *FunctionAST::CodegenFolded(Function *Canonical) {
+  const std::string &Name = Proto->getName();
+
+  // Re-evaluating an identical top-level expression just reruns its code.
+  if (Name.empty())
+    return Canonical;
+
+  // A private definition that nothing refers to yet becomes a pure alias:
+  // calls are resolved straight to the canonical body.
+  if (!Exported && !TheModule->getFunction(Name) &&
+      !FunctionAliases.count(Name)) {
+    FunctionAliases[Name] = Canonical->getName().str();
+    return Canonical;
+  }
+
+  // Otherwise the name has to exist as a real symbol, so emit a stub that
+  // tail calls the canonical body.
+  Function *F = Proto->Codegen();
+  if (F == 0)
+    return 0;
+
+  BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", F);
+  Builder.SetInsertPoint(BB);
+  ClearDebugLoc();
+  std::vector<Value*> ArgsV;
+  for (Function::arg_iterator AI = F->arg_begin(), E = F->arg_end(); AI != E;
+       ++AI)
+    ArgsV.push_back(AI);
+  CallInst *CI = CreateCallTo(Canonical, ArgsV, "folded");
+  CI->setTailCall();
+  Builder.CreateRet(CI);
+  verifyFunction(*F);
+  return F;
+}
+
 Function *FunctionAST::Codegen() {
   NamedValues.clear();
+
+  // If an identical body has already been compiled, share it rather than
+  // compiling this one again.
+  std::string Key = Profile();
+  std::map<std::string, Function*>::iterator Folded = FoldedBodies.find(Key);
+  if (Folded != FoldedBodies.end()) {
+    Function *F = CodegenFolded(Folded->second);
+    // If this is an operator, install it.
+    if (F && Proto->isBinaryOp())
+      BinopPrecedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+    return F;
+  }
   
   Function *TheFunction = Proto->Codegen();
   if (TheFunction == 0)
     return 0;
+
+  // Unexported definitions are private to the module.  A function that was
+  // forward declared with 'extern' may already have C-convention callers, so
+  // it keeps the linkage it was declared with.
+  if (!Exported && TheFunction->use_empty()) {
+    TheFunction->setLinkage(Function::InternalLinkage);
+    TheFunction->setCallingConv(CallingConv::Fast);
+  }
   
   // If this is an operator, install it.
   if (Proto->isBinaryOp())
@@ -974,20 +3012,51 @@ Function *FunctionAST::Codegen() {
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", TheFunction);
   Builder.SetInsertPoint(BB);
+  ClearDebugLoc();
+  if (RemarksEnabled()) {
+    LLVMContext &C = getGlobalContext();
+    Value *ScopeName = MDString::get(C, TheFunction->getName());
+    DebugScope = MDNode::get(C, ScopeName);
+  }
   
   // Add all arguments to the symbol table and create their allocas.
   Proto->CreateArgumentAllocas(TheFunction);
 
+  InstrFrame Frame = InstrFrame();
+  const InstrStats *Stats = 0;
+  if (Instrument) {
+    Frame = EmitInstrEntry(TheFunction);
+    Stats = &InstrTable.back();
+  }
+
+  unsigned LoopsBefore = LoopsEmitted;
   if (Value *RetVal = Body->Codegen()) {
     // Finish off the function.
+    if (Instrument)
+      EmitInstrExit(Frame);
     Builder.CreateRet(RetVal);
 
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
 
     // Optimize the function.
-    TheFPM->run(*TheFunction);
-    
+    OptTier Tier = SelectOptTier(*TheFunction, LoopsEmitted != LoopsBefore);
+    // The code cache keys on the function's attributes, so it sees the tier.
+    if (AdaptiveOpt)
+      TheFunction->addFnAttr("toy-opt-tier", OptTierNames[Tier]);
+    MetricTimer Optimize(hist_optimize);
+    RunOptPipeline(*TheFunction, Tier);
+    if (PassStats && PassStatsFunctions)
+      ReportFunctionPassStats(TheFunction->getName().str());
+
+    if (SplitCold)
+      SplitColdRegions(*TheFunction);
+    Optimize.stop();
+
+    SelectCodegenTier(*TheFunction);
+    NoteOptTier(TheFunction, Tier, Stats);
+
+    FoldedBodies[Key] = TheFunction;
     return TheFunction;
   }
   
@@ -1005,11 +3074,112 @@ Function *FunctionAST::Codegen() {
 
 static ExecutionEngine *TheExecutionEngine;
 
+/// TierUpHotFunctions - Re-optimize the definitions -instrument has seen
+/// called at least -tier-up-calls times with the aggressive pipeline, and
+/// relink them so that later calls run the new code.
+static void TierUpHotFunctions() {
+  std::map<Function*, TieredFunction>::iterator I, E;
+  for (I = TieredFunctions.begin(), E = TieredFunctions.end(); I != E; ++I) {
+    Function *F = I->first;
+    TieredFunction &T = I->second;
+    uint64_t Calls = T.Stats->Calls.load(std::memory_order_relaxed);
+    if (T.Tier == tier_aggressive || Calls < TierUpCalls || F->isDeclaration())
+      continue;
+
+    // Undo SelectCodegenTier's fast path; the function has earned better.
+    if (F->hasFnAttribute(Attribute::OptimizeNone)) {
+      F->removeFnAttr(Attribute::OptimizeNone);
+      if (!F->hasFnAttribute(Attribute::Cold))
+        F->removeFnAttr(Attribute::NoInline);
+    }
+
+    MetricTimer Optimize(hist_optimize);
+    RunOptPipeline(*F, tier_aggressive);
+    Optimize.stop();
+    MetricTimer JIT(hist_jit);
+    TheExecutionEngine->recompileAndRelinkFunction(F);
+    JIT.stop();
+
+    fprintf(stderr, "Tiered up %s from %s after %llu calls\n",
+            F->getName().str().c_str(), OptTierNames[T.Tier],
+            (unsigned long long)Calls);
+    T.Tier = tier_aggressive;
+  }
+}
+
+/// PendingExprs - In batch mode, the top-level expressions waiting to be
+/// evaluated once the whole module has been read and optimized.  They are
+/// held through value handles because whole-module passes may replace them:
+/// MergeFunctions turns one of two identical expressions (e.g. '2' and
+/// '1+1') into a thunk and erases the original.
+static std::vector<WeakVH> PendingExprs;
+
+/// Definitions - The AST of every definition by name, for the batch
+/// interpreter.
+static std::map<std::string, FunctionAST*> Definitions;
+
+static cl::opt<int>
+ReportResultsFd("report-results-fd", cl::init(-1), cl::Hidden,
+                cl::desc("At exit, write the exact value of every top-level "
+                         "expression to this descriptor"));
+
+/// ResultReport - One "result <bits>" line per evaluated expression.
+static std::string ResultReport;
+
+/// PrintResult - Report the value of a top-level expression.
+static void PrintResult(double Result) {
+  fprintf(stderr, "Evaluated to %f\n", Result);
+
+  if (ReportResultsFd >= 0) {
+    uint64_t Bits;
+    memcpy(&Bits, &Result, sizeof(Bits));
+    char Buf[32];
+    snprintf(Buf, sizeof(Buf), "result %016llx\n", (unsigned long long)Bits);
+    ResultReport += Buf;
+  }
+}
+
+/// EvaluateTopLevel - JIT an anonymous top-level function and print its value.
+static void EvaluateTopLevel(Function *LF) {
+  // JIT the function, returning a function pointer.
+  MetricTimer JIT(hist_jit);
+  void *FPtr = TheExecutionEngine->getPointerToFunction(LF);
+  JIT.stop();
+  
+  // Cast it to the right type (takes no arguments, returns a double) so we
+  // can call it as a native function.
+  double (*FP)() = (double (*)())(intptr_t)FPtr;
+  MetricTimer Execute(hist_execute);
+  double Result = FP();
+  Execute.stop();
+  PrintResult(Result);
+
+  TierUpHotFunctions();
+}
+
+static bool LoadFromCodeCache(Function *F, const std::string &Profile);
+
 static void HandleDefinition() {
-  if (FunctionAST *F = ParseDefinition()) {
-    if (Function *LF = F->Codegen()) {
-      fprintf(stderr, "Read function definition:");
-      LF->dump();
+  MetricTimer Parse(hist_parse);
+  FunctionAST *F = ParseDefinition();
+  Parse.stop();
+  if (F) {
+    MetricTimer Codegen(hist_codegen);
+    Function *LF = F->Codegen();
+    Codegen.stop();
+    if (LF) {
+      Definitions[F->getName()] = F;
+      if (LF->getName() != F->getName()) {
+        CountMetric(ctr_folded);
+        fprintf(stderr, "Folded %s into identical function %s\n",
+                F->getName().c_str(), LF->getName().str().c_str());
+      } else if (!BatchMode && LoadFromCodeCache(LF, F->Profile())) {
+        fprintf(stderr, "Loaded %s from the code cache\n",
+                F->getName().c_str());
+      } else {
+        fprintf(stderr, "Read function definition:");
+        LF->dump();
+      }
     }
   } else {
     // Skip token for error recovery.
@@ -1018,8 +3188,14 @@ static void HandleDefinition() {
 }
 
 static void HandleExtern() {
-  if (PrototypeAST *P = ParseExtern()) {
-    if (Function *F = P->Codegen()) {
+  MetricTimer Parse(hist_parse);
+  PrototypeAST *P = ParseExtern();
+  Parse.stop();
+  if (P) {
+    MetricTimer Codegen(hist_codegen);
+    Function *F = P->Codegen();
+    Codegen.stop();
+    if (F) {
       fprintf(stderr, "Read extern: ");
       F->dump();
     }
@@ -1031,15 +3207,18 @@ static void HandleExtern() {
 
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
-  if (FunctionAST *F = ParseTopLevelExpr()) {
-    if (Function *LF = F->Codegen()) {
-      // JIT the function, returning a function pointer.
-      void *FPtr = TheExecutionEngine->getPointerToFunction(LF);
-      
-      // Cast it to the right type (takes no arguments, returns a double) so we
-      // can call it as a native function.
-      double (*FP)() = (double (*)())(intptr_t)FPtr;
-      fprintf(stderr, "Evaluated to %f\n", FP());
+  MetricTimer Parse(hist_parse);
+  FunctionAST *F = ParseTopLevelExpr();
+  Parse.stop();
+  if (F) {
+    MetricTimer Codegen(hist_codegen);
+    Function *LF = F->Codegen();
+    Codegen.stop();
+    if (LF) {
+      if (BatchMode)
+        PendingExprs.push_back(LF);
+      else
+        EvaluateTopLevel(LF);
     }
   } else {
     // Skip token for error recovery.
@@ -1048,100 +3227,4297 @@ static void HandleTopLevelExpression() {
 }
 
 /// top ::= definition | external | expression | ';'
+static cl::opt<int>
+ReportItemsFd("report-items-fd", cl::init(-1), cl::Hidden,
+              cl::desc("At exit, write the compile and execute time in "
+                       "nanoseconds of every top-level item to this "
+                       "descriptor"));
+
+/// ItemReport - One "kind compile-ns execute-ns" line per top-level item.
+static std::string ItemReport;
+
+/// ItemTimes - The compile and execute time recorded so far.  Compiling
+/// covers parsing, codegen (which includes optimization) and the JIT.
+static void ItemTimes(uint64_t &CompileNs, uint64_t &ExecuteNs) {
+  CompileNs = MetricSumNs(hist_parse) + MetricSumNs(hist_codegen) +
+              MetricSumNs(hist_jit);
+  ExecuteNs = MetricSumNs(hist_execute);
+}
+
 static void MainLoop() {
   while (1) {
     fprintf(stderr, "ready> ");
+    const char *Kind = 0;
+    uint64_t CompileNs = 0, ExecuteNs = 0;
+    if (ReportItemsFd >= 0)
+      ItemTimes(CompileNs, ExecuteNs);
     switch (CurTok) {
     case tok_eof:    return;
     case ';':        getNextToken(); break;  // ignore top-level semicolons.
-    case tok_def:    HandleDefinition(); break;
-    case tok_extern: HandleExtern(); break;
-    default:         HandleTopLevelExpression(); break;
+    case tok_export:
+    case tok_def:    HandleDefinition(); Kind = "def"; break;
+    case tok_extern: HandleExtern(); Kind = "extern"; break;
+    default:         HandleTopLevelExpression(); Kind = "expr"; break;
+    }
+    if (Kind && ReportItemsFd >= 0) {
+      uint64_t CompileEnd, ExecuteEnd;
+      ItemTimes(CompileEnd, ExecuteEnd);
+      char Buf[64];
+      snprintf(Buf, sizeof(Buf), "%s %llu %llu\n", Kind,
+               (unsigned long long)(CompileEnd - CompileNs),
+               (unsigned long long)(ExecuteEnd - ExecuteNs));
+      ItemReport += Buf;
     }
   }
 }
 
-//===----------------------------------------------------------------------===//
-// "Library" functions that can be "extern'd" from user code.
-//===----------------------------------------------------------------------===//
+/// MoreCallSites - Order functions by how many places refer to them.
+static bool MoreCallSites(const Function *A, const Function *B) {
+  return A->getNumUses() > B->getNumUses();
+}
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" 
-double putchard(double X) {
-  putchar((char)X);
-  return 0;
+/// EmitInLayoutOrder - JIT every function in the module up front so that hot
+/// code ends up contiguous in JIT memory.  Cold functions, including regions
+/// split out by SplitColdRegions, are emitted first as one group; the JIT
+/// emits callees right after their caller, so doing the cold group last would
+/// scatter it between hot functions.  The hot functions follow, most widely
+/// called first.
+static void EmitInLayoutOrder() {
+  MetricTimer JIT(hist_jit);
+  std::vector<Function*> Hot, Cold;
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end(); F != E;
+       ++F) {
+    if (F->isDeclaration())
+      continue;
+    if (F->hasFnAttribute(Attribute::Cold))
+      Cold.push_back(F);
+    else
+      Hot.push_back(F);
+  }
+  std::stable_sort(Hot.begin(), Hot.end(), MoreCallSites);
+
+  for (unsigned i = 0, e = Cold.size(); i != e; ++i)
+    TheExecutionEngine->getPointerToFunction(Cold[i]);
+  for (unsigned i = 0, e = Hot.size(); i != e; ++i)
+    TheExecutionEngine->getPointerToFunction(Hot[i]);
 }
 
-/// printd - printf that takes a double prints it as "%f\n", returning 0.
-extern "C" 
-double printd(double X) {
-  printf("%f\n", X);
-  return 0;
+/// OptimizeModule - Optimize the whole module now that every definition is
+/// known.  Only exported functions and the top-level expressions are
+/// externally visible, so the interprocedural passes are free to rewrite
+/// everything else.
+static void OptimizeModule() {
+  MetricTimer Optimize(hist_optimize);
+  PassManager MPM;
+  MPM.add(new DataLayoutPass(TheModule));
+  // Fold definitions that became identical at the IR level, which catches
+  // duplicates the AST profile can't see (e.g. after constant folding).
+  MPM.add(createMergeFunctionsPass());
+  // Propagate constant arguments and drop arguments nobody uses.
+  MPM.add(createIPSCCPPass());
+  MPM.add(createDeadArgEliminationPass());
+  // Inline internal definitions into their callers and clean up afterwards.
+  if (ActivePipeline.InlineThreshold >= 0)
+    MPM.add(createFunctionInliningPass(ActivePipeline.InlineThreshold));
+  else
+    MPM.add(createFunctionInliningPass());
+  MPM.add(createInstructionCombiningPass());
+  MPM.add(createCFGSimplificationPass());
+  // Delete internal definitions that are no longer referenced.
+  MPM.add(createGlobalDCEPass());
+  MPM.run(*TheModule);
+}
+
+/// RunBatch - Optimize the whole module, then evaluate the pending top-level
+/// expressions in source order.
+static void RunBatch() {
+  OptimizeModule();
+  EmitInLayoutOrder();
+
+  for (unsigned i = 0, e = PendingExprs.size(); i != e; ++i)
+    if (Function *F = dyn_cast_or_null<Function>(PendingExprs[i]))
+      EvaluateTopLevel(F);
+  PendingExprs.clear();
 }
 
 //===----------------------------------------------------------------------===//
-// Main driver code.
+// Ahead-of-time Compilation
 //===----------------------------------------------------------------------===//
 
-int main() {
-  LLVMInitializeNativeTarget();
-  LLVMContext &Context = getGlobalContext();
+static cl::opt<std::string>
+EmitObj("emit-obj", cl::value_desc("file"),
+        cl::desc("Compile the input to a relocatable object file instead of "
+                 "running it; only exported definitions are visible"));
 
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40;  // highest.
+static cl::opt<unsigned>
+CodegenJobs("codegen-jobs", cl::init(0),
+            cl::desc("Threads used to emit machine code for -emit-obj "
+                     "(0 = one per core)"));
 
-  // Prime the first token.
-  fprintf(stderr, "ready> ");
-  getNextToken();
+/// MinPartitionInstructions - The least work worth a codegen thread of its
+/// own.  Smaller modules are emitted in one piece, which also avoids the
+/// dependency on 'ld'.
+static const unsigned MinPartitionInstructions = 2000;
+
+/// RunProgram - Run Args[0], found on PATH, with Args and wait for it.
+/// Arguments go to the program as they are, never through a shell.  Return
+/// false if it couldn't be started or didn't exit successfully.
+static bool RunProgram(const std::vector<std::string> &Args) {
+  std::vector<const char*> Argv;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    Argv.push_back(Args[i].c_str());
+  Argv.push_back(0);
+
+  fflush(stdout);
+  fflush(stderr);
+  pid_t Pid = fork();
+  if (Pid == 0) {
+    execvp(Argv[0], (char *const *)&Argv[0]);
+    _exit(127);
+  }
+  if (Pid < 0)
+    return false;
+  int Status;
+  pid_t R;
+  while ((R = waitpid(Pid, &Status, 0)) < 0 && errno == EINTR)
+    ;
+  return R == Pid && WIFEXITED(Status) && WEXITSTATUS(Status) == 0;
+}
+
+/// CreateTargetMachine - Create a target machine for the host that emits
+/// position independent code, so objects can go into shared libraries.
+static TargetMachine *CreateTargetMachine() {
+  std::string Triple = sys::getProcessTriple();
+  std::string Err;
+  const Target *T = TargetRegistry::lookupTarget(Triple, Err);
+  if (!T) {
+    fprintf(stderr, "Error: %s\n", Err.c_str());
+    return 0;
+  }
+  return T->createTargetMachine(Triple, sys::getHostCPUName(), "",
+                                TargetOptions(), Reloc::PIC_,
+                                CodeModel::Default,
+                                (CodeGenOpt::Level)(unsigned)CodegenOptLevel);
+}
+
+/// EmitModule - Run the backend over M and write an object file to Path.
+static bool EmitModule(Module &M, const std::string &Path) {
+  std::unique_ptr<TargetMachine> TM(CreateTargetMachine());
+  if (!TM)
+    return false;
+
+  std::string Err;
+  raw_fd_ostream Out(Path.c_str(), Err, sys::fs::F_None);
+  if (!Err.empty()) {
+    fprintf(stderr, "Error: %s\n", Err.c_str());
+    return false;
+  }
+  formatted_raw_ostream FOS(Out);
+
+  PassManager PM;
+  M.setDataLayout(TM->getDataLayout());
+  PM.add(new DataLayoutPass(&M));
+  if (TM->addPassesToEmitFile(PM, FOS, TargetMachine::CGFT_ObjectFile)) {
+    fprintf(stderr, "Error: target can't emit object files\n");
+    return false;
+  }
+  PM.run(M);
+  return true;
+}
+
+/// EmitPartition - Emit the functions assigned to partition Part.  Each
+/// partition runs on its own thread, so it parses a private copy of the
+/// module into its own context and turns every function it doesn't own into
+/// a declaration.  Global variables all live in partition 0.
+static void EmitPartition(StringRef Bitcode,
+                          const std::map<std::string, unsigned> *PartitionOf,
+                          unsigned Part, std::string Path, char *Ok) {
+  LLVMContext Context;
+  MemoryBuffer *Buffer = MemoryBuffer::getMemBuffer(Bitcode, "", false);
+  ErrorOr<Module*> MOrErr = parseBitcodeFile(Buffer, Context);
+  delete Buffer;
+  if (std::error_code EC = MOrErr.getError()) {
+    fprintf(stderr, "Error: %s\n", EC.message().c_str());
+    return;
+  }
+  std::unique_ptr<Module> M(MOrErr.get());
+
+  // Anything the partitioner didn't see belongs to partition 0, like the
+  // global variables.
+  for (Module::iterator F = M->begin(), E = M->end(); F != E; ++F) {
+    if (F->isDeclaration())
+      continue;
+    std::map<std::string, unsigned>::const_iterator I =
+      PartitionOf->find(F->getName().str());
+    if ((I == PartitionOf->end() ? 0 : I->second) != Part)
+      F->deleteBody();
+  }
+  if (Part != 0)
+    for (Module::global_iterator G = M->global_begin(), E = M->global_end();
+         G != E; ++G)
+      if (!G->isDeclaration()) {
+        G->setInitializer(0);
+        G->setLinkage(GlobalValue::ExternalLinkage);
+      }
+
+  *Ok = EmitModule(*M, Path);
+}
+
+/// MoreInstructions - Order functions by size, largest first.
+static bool MoreInstructions(const Function *A, const Function *B) {
+  return CountInstructions(*A) > CountInstructions(*B);
+}
+
+/// CompileToObject - Optimize the module and write it to Path as one
+/// relocatable object.  Large modules are split into one partition per
+/// codegen thread, each with at least MinPartitionInstructions; the partial
+/// objects are then combined with 'ld -r'.
+static bool CompileToObject(const std::string &Path) {
+  // Top-level expressions can't run at compile time.  Dropping them first
+  // lets global DCE delete whatever only they used.
+  std::set<Function*> Dropped;
+  for (unsigned i = 0, e = PendingExprs.size(); i != e; ++i)
+    Dropped.insert(cast<Function>(PendingExprs[i]));
+  if (!Dropped.empty())
+    fprintf(stderr, "Warning: ignoring %u top-level expression(s)\n",
+            (unsigned)Dropped.size());
+  for (std::set<Function*>::iterator I = Dropped.begin(), E = Dropped.end();
+       I != E; ++I)
+    (*I)->eraseFromParent();
+  PendingExprs.clear();
+
+  OptimizeModule();
+
+  std::vector<Function*> Defs;
+  unsigned Total = 0;
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end(); F != E;
+       ++F)
+    if (!F->isDeclaration()) {
+      Defs.push_back(F);
+      Total += CountInstructions(*F);
+    }
+
+  unsigned Jobs = CodegenJobs ? CodegenJobs : std::thread::hardware_concurrency();
+  Jobs = std::min(Jobs, (unsigned)Defs.size());
+  Jobs = std::min(Jobs, Total / MinPartitionInstructions);
+  if (Jobs <= 1)
+    return EmitModule(*TheModule, Path);
+
+  // Balance the partitions by instruction count: hand out the largest
+  // functions first, each to the least loaded partition.
+  std::stable_sort(Defs.begin(), Defs.end(), MoreInstructions);
+  std::vector<unsigned> Load(Jobs);
+  std::map<std::string, unsigned> PartitionOf;
+  for (unsigned i = 0, e = Defs.size(); i != e; ++i) {
+    unsigned Part = std::min_element(Load.begin(), Load.end()) - Load.begin();
+    Load[Part] += CountInstructions(*Defs[i]);
+    PartitionOf[Defs[i]->getName().str()] = Part;
+  }
+
+  // Partitions call into each other, so nothing may stay internal.  Hidden
+  // visibility keeps the promoted symbols out of a shared library's exports.
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end(); F != E;
+       ++F)
+    if (F->hasLocalLinkage()) {
+      F->setLinkage(GlobalValue::ExternalLinkage);
+      F->setVisibility(GlobalValue::HiddenVisibility);
+    }
+  for (Module::global_iterator G = TheModule->global_begin(),
+       E = TheModule->global_end(); G != E; ++G)
+    if (G->hasLocalLinkage()) {
+      G->setLinkage(GlobalValue::ExternalLinkage);
+      G->setVisibility(GlobalValue::HiddenVisibility);
+    }
+
+  SmallString<0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(TheModule, OS);
+  OS.flush();
+
+  std::vector<std::string> Parts(Jobs);
+  std::vector<char> Ok(Jobs);
+  std::vector<std::thread> Threads;
+  for (unsigned i = 0; i != Jobs; ++i) {
+    char Suffix[32];
+    snprintf(Suffix, sizeof(Suffix), ".part%u.o", i);
+    Parts[i] = Path + Suffix;
+    Threads.push_back(std::thread(EmitPartition, StringRef(Bitcode),
+                                  &PartitionOf, i, Parts[i], &Ok[i]));
+  }
+  for (unsigned i = 0; i != Jobs; ++i)
+    Threads[i].join();
+
+  bool Success = std::find(Ok.begin(), Ok.end(), 0) == Ok.end();
+  if (Success) {
+    std::vector<std::string> Args;
+    Args.push_back("ld");
+    Args.push_back("-r");
+    Args.push_back("-o");
+    Args.push_back(Path);
+    Args.insert(Args.end(), Parts.begin(), Parts.end());
+    if (!RunProgram(Args)) {
+      fprintf(stderr, "Error: failed to link partial objects\n");
+      Success = false;
+    }
+  }
+  for (unsigned i = 0; i != Jobs; ++i)
+    remove(Parts[i].c_str());
+  return Success;
+}
+
+//===----------------------------------------------------------------------===//
+// Shared Code Cache
+//===----------------------------------------------------------------------===//
+
+// Processes on the same machine tend to compile the same functions.  With
+// -code-cache, each definition is looked up in a cache directory (normally on
+// tmpfs) before it is handed to the JIT.  Entries are shared libraries named
+// by a hash of the definition, so a hit is a dlopen: the code is mapped
+// read-only and executable, and its pages are shared by every process using
+// it.  A miss compiles the definition into a new entry and then loads that.
+//
+// The directory's index file is a shared, append-only hash table of the keys
+// that have been published.  Lookups are plain atomic loads and publication is
+// a compare-and-swap into an empty slot, so no process ever takes a lock.  An
+// entry's library is renamed into place before its key is published.
+//
+// Only definitions whose callees are externs, cached definitions or
+// themselves can be cached, since the library has to be loadable on its own.
+// Batch mode doesn't use the cache: it optimizes across definitions.
+
+static cl::opt<std::string>
+CodeCacheDir("code-cache", cl::value_desc("directory"),
+             cl::desc("Share compiled definitions with other processes "
+                      "through this directory, which must be private to "
+                      "this user; building entries needs a C compiler "
+                      "('cc') on PATH"));
+
+/// CodeCacheSlots - The capacity of the index.  Must be a power of two.
+static const unsigned CodeCacheSlots = 1 << 16;
+static const unsigned CodeCacheMaxProbes = 64;
+
+/// CodeCacheKeys - The mapped index, or null if the cache is off.  A zero
+/// slot is empty.
+static std::atomic<uint64_t> *CodeCacheKeys;
+
+/// CachedSymbols - For each definition loaded from the cache, the symbol
+/// that its library exports and the key it was found under.
+static std::map<Function*, std::pair<std::string, uint64_t> > CachedSymbols;
+
+/// InitCodeCache - Create the cache directory if needed and map its index.
+/// Entries are loaded as code, so a directory that anyone else could write
+/// to is refused.
+static bool InitCodeCache() {
+  if (mkdir(CodeCacheDir.c_str(), 0700) != 0 && errno != EEXIST) {
+    perror(CodeCacheDir.c_str());
+    return false;
+  }
+  struct stat Dir;
+  if (lstat(CodeCacheDir.c_str(), &Dir) != 0) {
+    perror(CodeCacheDir.c_str());
+    return false;
+  }
+  if (!S_ISDIR(Dir.st_mode) || Dir.st_uid != geteuid() ||
+      (Dir.st_mode & (S_IWGRP | S_IWOTH))) {
+    fprintf(stderr, "Error: code cache %s must be a directory owned by this "
+            "user and writable by nobody else\n", CodeCacheDir.c_str());
+    return false;
+  }
+  std::string Path = CodeCacheDir + "/index";
+  int FD = open(Path.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+  if (FD < 0) {
+    perror(Path.c_str());
+    return false;
+  }
+  // Every process grows the file to the same size, so racing is harmless.
+  size_t Size = CodeCacheSlots * sizeof(std::atomic<uint64_t>);
+  struct stat St;
+  void *Map = MAP_FAILED;
+  if (fstat(FD, &St) == 0 &&
+      ((size_t)St.st_size >= Size || ftruncate(FD, Size) == 0))
+    Map = mmap(0, Size, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+  close(FD);
+  if (Map == MAP_FAILED) {
+    perror(Path.c_str());
+    return false;
+  }
+  CodeCacheKeys = (std::atomic<uint64_t>*)Map;
+  return true;
+}
+
+/// CodeCacheContains - Return true if Key has been published.
+static bool CodeCacheContains(uint64_t Key) {
+  for (unsigned i = 0; i != CodeCacheMaxProbes; ++i) {
+    uint64_t K = CodeCacheKeys[(Key + i) & (CodeCacheSlots - 1)]
+                   .load(std::memory_order_acquire);
+    if (K == Key)
+      return true;
+    if (K == 0)
+      return false;
+  }
+  return false;
+}
+
+/// CodeCachePublish - Add Key to the index.  Another process publishing the
+/// same key at the same time is fine; a full probe sequence just means the
+/// entry won't be found by others.
+static void CodeCachePublish(uint64_t Key) {
+  for (unsigned i = 0; i != CodeCacheMaxProbes; ++i) {
+    uint64_t Expected = 0;
+    if (CodeCacheKeys[(Key + i) & (CodeCacheSlots - 1)]
+          .compare_exchange_strong(Expected, Key, std::memory_order_release,
+                                   std::memory_order_acquire) ||
+        Expected == Key)
+      return;
+  }
+}
+
+/// HashBytes - 64-bit FNV-1a, which unlike llvm::hash_value is stable across
+/// processes.
+static uint64_t HashBytes(uint64_t Hash, StringRef Bytes) {
+  for (unsigned i = 0, e = Bytes.size(); i != e; ++i) {
+    Hash ^= (unsigned char)Bytes[i];
+    Hash *= 0x100000001b3ULL;
+  }
+  return Hash;
+}
+
+/// CodeCacheKey - Compute F's cache key from its structural profile, how it
+/// is compiled and what it calls.  How it is compiled covers the IR pipeline
+/// (-pipeline or -pipeline-config, -loop-opts, and the -adaptive-opt tier,
+/// which is one of F's attributes) as well as the backend.  Returns 0 if F
+/// can't be cached.
+static uint64_t CodeCacheKey(Function *F, const std::string &Profile) {
+  uint64_t Key = 0xcbf29ce484222325ULL;
+  Key = HashBytes(Key, "toy-code-cache-1 " __DATE__ " " __TIME__);
+  Key = HashBytes(Key, sys::getProcessTriple());
+  Key = HashBytes(Key, sys::getHostCPUName());
+  Key = HashBytes(Key, std::string(1, '0' + (unsigned)CodegenOptLevel));
+  char Pipeline[64];
+  snprintf(Pipeline, sizeof(Pipeline), " vw=%u loop-opts=%d adaptive=%d ",
+           ActivePipeline.VectorWidth, (int)LoopOpts, (int)AdaptiveOpt);
+  Key = HashBytes(Key, Pipeline);
+  Key = HashBytes(Key, FormatPipelineSpec(ActivePipeline.Steps));
+  Key = HashBytes(Key, Profile);
+  Key = HashBytes(Key, F->getAttributes().getAsString(
+                         AttributeSet::FunctionIndex));
+  Key = HashBytes(Key, std::string(1, (char)F->getCallingConv()));
+
+  for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB)
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I)
+      for (unsigned Op = 0, e = I->getNumOperands(); Op != e; ++Op) {
+        Function *Callee = dyn_cast<Function>(I->getOperand(Op));
+        if (!Callee || Callee == F)
+          continue;
+        std::string Type;
+        raw_string_ostream OS(Type);
+        Callee->getFunctionType()->print(OS);
+        Key = HashBytes(Key, Callee->getName());
+        Key = HashBytes(Key, OS.str());
+
+        std::map<Function*, std::pair<std::string, uint64_t> >::iterator C =
+          CachedSymbols.find(Callee);
+        if (C != CachedSymbols.end()) {
+          char Buf[17];
+          snprintf(Buf, sizeof(Buf), "%016llx",
+                   (unsigned long long)C->second.second);
+          Key = HashBytes(Key, Buf);
+        } else if (!Callee->isDeclaration() ||
+                   Definitions.count(Callee->getName().str())) {
+          return 0;  // Calls code that only exists in this process.
+        }
+      }
+  return Key ? Key : 1;
+}
+
+/// DeclareReferencedGlobals - Declare in M each global that V refers to,
+/// directly or through constant expressions, and map it in VMap.  Calls to
+/// cached definitions go to their libraries' symbols.
+static void DeclareReferencedGlobals(Value *V, Module *M,
+                                     ValueToValueMapTy &VMap) {
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    if (VMap.count(GV))
+      return;
+    if (Function *Callee = dyn_cast<Function>(GV)) {
+      std::map<Function*, std::pair<std::string, uint64_t> >::iterator C =
+        CachedSymbols.find(Callee);
+      Function *D = Function::Create(Callee->getFunctionType(),
+                                     GlobalValue::ExternalLinkage,
+                                     C != CachedSymbols.end()
+                                       ? C->second.first
+                                       : Callee->getName().str(), M);
+      D->setCallingConv(Callee->getCallingConv());
+      D->setAttributes(Callee->getAttributes());
+      VMap[GV] = D;
+    } else if (GlobalVariable *G = dyn_cast<GlobalVariable>(GV)) {
+      VMap[GV] = new GlobalVariable(*M, G->getType()->getElementType(),
+                                    G->isConstant(),
+                                    GlobalValue::ExternalLinkage, 0,
+                                    G->getName());
+    }
+    return;
+  }
+  if (ConstantExpr *CE = dyn_cast<ConstantExpr>(V))
+    for (unsigned i = 0, e = CE->getNumOperands(); i != e; ++i)
+      DeclareReferencedGlobals(CE->getOperand(i), M, VMap);
+}
+
+/// BuildCacheEntry - Compile F on its own into the shared library Path,
+/// exporting it as Symbol.
+static bool BuildCacheEntry(Function *F, const std::string &Symbol,
+                            const std::string &Path) {
+  // Copy F alone into a new module, with declarations of what it uses.
+  // Cloning the whole module would make filling the cache quadratic.
+  std::unique_ptr<Module> M(new Module(Symbol, getGlobalContext()));
+  M->setTargetTriple(TheModule->getTargetTriple());
+  M->setDataLayout(TheModule->getDataLayout());
+  Function *Target = Function::Create(F->getFunctionType(),
+                                      GlobalValue::ExternalLinkage, Symbol,
+                                      M.get());
+  ValueToValueMapTy VMap;
+  VMap[F] = Target;
+  Function::arg_iterator TI = Target->arg_begin();
+  for (Function::arg_iterator AI = F->arg_begin(), AE = F->arg_end();
+       AI != AE; ++AI, ++TI) {
+    TI->setName(AI->getName());
+    VMap[AI] = TI;
+  }
+  for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB)
+    for (BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I)
+      for (unsigned Op = 0, e = I->getNumOperands(); Op != e; ++Op)
+        DeclareReferencedGlobals(I->getOperand(Op), M.get(), VMap);
+
+  SmallVector<ReturnInst*, 4> Returns;
+  CloneFunctionInto(Target, F, VMap, /*ModuleLevelChanges=*/true, Returns);
+  Target->setCallingConv(F->getCallingConv());
+  Target->setLinkage(GlobalValue::ExternalLinkage);
+  Target->setVisibility(GlobalValue::DefaultVisibility);
+
+  // Build under private names and rename into place, so that other processes
+  // never see a partial file.
+  char Suffix[32];
+  snprintf(Suffix, sizeof(Suffix), ".%d", (int)getpid());
+  std::string Obj = Path + Suffix + ".o", Tmp = Path + Suffix;
+  bool Ok = EmitModule(*M, Obj);
+  if (Ok) {
+    std::vector<std::string> Args;
+    Args.push_back("cc");
+    Args.push_back("-shared");
+    Args.push_back("-o");
+    Args.push_back(Tmp);
+    Args.push_back(Obj);
+    Ok = RunProgram(Args) && rename(Tmp.c_str(), Path.c_str()) == 0;
+  }
+  remove(Obj.c_str());
+  if (!Ok)
+    remove(Tmp.c_str());
+  return Ok;
+}
+
+/// LoadFromCodeCache - Find F in the code cache, adding it on a miss, and
+/// point the JIT at the cached code.  F's body is dropped, so the JIT never
+/// compiles it.  Returns false, leaving F alone, if the cache is off or can't
+/// be used for F.
+static bool LoadFromCodeCache(Function *F, const std::string &Profile) {
+  // Instrumented code points at this process's counters.
+  if (!CodeCacheKeys || F->getName().empty() || Instrument)
+    return false;
+  uint64_t Key = CodeCacheKey(F, Profile);
+  if (!Key)
+    return false;
+
+  char Name[32];
+  snprintf(Name, sizeof(Name), "%016llx", (unsigned long long)Key);
+  std::string Symbol = std::string("toy_cached_") + Name;
+  std::string Path = CodeCacheDir + "/" + Name + ".so";
+
+  if (CodeCacheContains(Key)) {
+    CountMetric(ctr_code_cache_hits);
+  } else {
+    CountMetric(ctr_code_cache_misses);
+    if (!BuildCacheEntry(F, Symbol, Path))
+      return false;
+    CodeCachePublish(Key);
+  }
+
+  // Cached libraries that call each other find one another through the
+  // global namespace.
+  void *Handle = dlopen(Path.c_str(), RTLD_NOW | RTLD_GLOBAL);
+  void *Code = Handle ? dlsym(Handle, Symbol.c_str()) : 0;
+  if (!Code) {
+    fprintf(stderr, "Warning: unusable code cache entry %s: %s\n",
+            Path.c_str(), dlerror());
+    if (Handle)
+      dlclose(Handle);
+    return false;
+  }
+
+  F->deleteBody();
+  TheExecutionEngine->addGlobalMapping(F, Code);
+  CachedSymbols[F] = std::make_pair(Symbol, Key);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Row Streaming
+//===----------------------------------------------------------------------===//
+
+static cl::opt<std::string>
+RowsFn("rows", cl::value_desc("function"),
+       cl::desc("Evaluate the named function over every row of the row "
+                "input, one result per row, instead of reading source from "
+                "stdin"));
+
+static cl::opt<std::string>
+RowsInput("rows-input", cl::init("-"), cl::value_desc("file"),
+          cl::desc("Where -rows reads rows from (default: stdin)"));
+
+static cl::opt<std::string>
+RowsOutput("rows-output", cl::init("-"), cl::value_desc("file"),
+           cl::desc("Where -rows writes results to (default: stdout)"));
+
+static cl::opt<bool>
+RowsBinary("rows-binary",
+           cl::desc("Rows are packed native-endian doubles, and so are the "
+                    "results; otherwise rows are lines of numbers separated "
+                    "by spaces, tabs, commas or semicolons"));
+
+static cl::opt<unsigned>
+RowsThreads("rows-threads", cl::init(0),
+            cl::desc("Worker threads for -rows (0 = one per core)"));
+
+/// RowBlockSize - How much input the reader hands to a worker at a time.
+static const size_t RowBlockSize = 4 << 20;
+
+/// RowBatchFn - The compiled row loop: evaluates the function for Count
+/// rows of Arity doubles starting at In, and stores one result per row.
+typedef void (*RowBatchFn)(const double *In, double *Out, uint64_t Count);
+
+/// CreateRowBatchFunction - Emit a loop that applies F to each row of a
+/// packed row buffer.  Calling it once per block, rather than F once per row,
+/// lets F be inlined into the loop and keeps the JIT'd code out of the
+/// driver's per-row overhead.
+static Function *CreateRowBatchFunction(Function *F) {
+  LLVMContext &C = getGlobalContext();
+  Type *DoublePtrTy = Type::getDoublePtrTy(C);
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Type *Params[] = { DoublePtrTy, DoublePtrTy, Int64Ty };
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(C), Params, false);
+  Function *Batch = Function::Create(FT, Function::ExternalLinkage,
+                                     "__rows_" + F->getName(), TheModule);
+  Function::arg_iterator AI = Batch->arg_begin();
+  Value *In = AI++, *Out = AI++, *Count = AI++;
+
+  BasicBlock *Entry = BasicBlock::Create(C, "entry", Batch);
+  BasicBlock *Loop = BasicBlock::Create(C, "loop", Batch);
+  BasicBlock *Exit = BasicBlock::Create(C, "exit", Batch);
+  Builder.SetInsertPoint(Entry);
+  ClearDebugLoc();
+  Value *Zero = ConstantInt::get(Int64Ty, 0);
+  Builder.CreateCondBr(Builder.CreateICmpEQ(Count, Zero), Exit, Loop);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *Row = Builder.CreatePHI(Int64Ty, 2, "row");
+  Row->addIncoming(Zero, Entry);
+  Value *Base = Builder.CreateMul(Row, ConstantInt::get(Int64Ty,
+                                                        F->arg_size()));
+  std::vector<Value*> Args;
+  for (unsigned i = 0, e = F->arg_size(); i != e; ++i) {
+    Value *Idx = Builder.CreateAdd(Base, ConstantInt::get(Int64Ty, i));
+    Args.push_back(Builder.CreateLoad(Builder.CreateInBoundsGEP(In, Idx)));
+  }
+  Value *Result = CreateCallTo(F, Args, "result");
+  Builder.CreateStore(Result, Builder.CreateInBoundsGEP(Out, Row));
+  Value *Next = Builder.CreateAdd(Row, ConstantInt::get(Int64Ty, 1), "next");
+  Row->addIncoming(Next, Loop);
+  Builder.CreateCondBr(Builder.CreateICmpULT(Next, Count), Loop, Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+  verifyFunction(*Batch);
+  return Batch;
+}
+
+/// RowBlock - A block of raw input and, once a worker is done with it, the
+/// formatted results for its rows.
+struct RowBlock {
+  uint64_t Seq;
+  std::string Data;
+  std::string Output;
+  unsigned BadRows;
+};
+
+/// RowStream - The state shared by the reader, the workers and the writer.
+/// The reader stops reading ahead once MaxInFlight blocks are queued or
+/// waiting to be written, which bounds memory use.
+struct RowStream {
+  std::mutex Lock;
+  std::condition_variable Changed;
+  std::deque<RowBlock*> Todo;
+  std::map<uint64_t, RowBlock*> Done;
+  unsigned InFlight, MaxInFlight;
+  bool EndOfInput;
+
+  RowBatchFn Fn;
+  unsigned Arity;
+};
+
+/// ParseTextRows - Append the numbers on each line of Text to Values, which
+/// gets exactly Arity values per line.  Lines with too few or too many
+/// numbers become a row of NaNs, since they can't be evaluated.
+static unsigned ParseTextRows(const std::string &Text, unsigned Arity,
+                              std::vector<double> &Values) {
+  unsigned BadRows = 0;
+  const char *P = Text.data(), *End = P + Text.size();
+  while (P != End) {
+    const char *EOL = (const char *)memchr(P, '\n', End - P);
+    if (!EOL) EOL = End;
+
+    size_t RowStart = Values.size();
+    unsigned Fields = 0;
+    bool Bad = false;
+    while (true) {
+      while (P != EOL && (*P == ' ' || *P == '\t' || *P == ',' || *P == ';' ||
+                          *P == '\r'))
+        ++P;
+      if (P == EOL)
+        break;
+      char *NumEnd;
+      double V = strtod(P, &NumEnd);
+      if (NumEnd == P || NumEnd > EOL) {
+        Bad = true;
+        break;
+      }
+      if (++Fields <= Arity)
+        Values.push_back(V);
+      P = NumEnd;
+    }
+    P = EOL == End ? End : EOL + 1;
+
+    if (Fields == 0 && !Bad)
+      continue;  // Blank line.
+    if (Bad || Fields != Arity) {
+      Values.resize(RowStart);
+      Values.resize(RowStart + Arity, std::numeric_limits<double>::quiet_NaN());
+      ++BadRows;
+    }
+  }
+  return BadRows;
+}
+
+/// RowWorker - Take blocks off the queue, parse them, run the compiled row
+/// loop over the whole block and format the results.
+static void RowWorker(RowStream *S) {
+  std::vector<double> In, Out;
+  while (true) {
+    RowBlock *B;
+    {
+      std::unique_lock<std::mutex> Guard(S->Lock);
+      while (S->Todo.empty() && !S->EndOfInput)
+        S->Changed.wait(Guard);
+      if (S->Todo.empty())
+        return;
+      B = S->Todo.front();
+      S->Todo.pop_front();
+    }
+
+    uint64_t Count;
+    if (RowsBinary) {
+      Count = B->Data.size() / (sizeof(double) * S->Arity);
+      Out.resize(Count);
+      S->Fn((const double *)B->Data.data(), Out.data(), Count);
+      B->Output.assign((const char *)Out.data(), Count * sizeof(double));
+    } else {
+      In.clear();
+      B->BadRows = ParseTextRows(B->Data, S->Arity, In);
+      Count = S->Arity ? In.size() / S->Arity : 0;
+      Out.resize(Count);
+      S->Fn(In.data(), Out.data(), Count);
+      B->Output.clear();
+      char Buf[32];
+      for (uint64_t i = 0; i != Count; ++i) {
+        int Len = snprintf(Buf, sizeof(Buf), "%.17g\n", Out[i]);
+        B->Output.append(Buf, Len);
+      }
+    }
+    B->Data.clear();
+
+    std::lock_guard<std::mutex> Guard(S->Lock);
+    S->Done[B->Seq] = B;
+    S->Changed.notify_all();
+  }
+}
+
+/// RowReader - Read the input in large blocks and queue them for the workers.
+/// Blocks are cut at a row boundary; the partial row at the end of a read
+/// carries over to the next block.
+static void RowReader(RowStream *S, FILE *In) {
+  size_t RowBytes = sizeof(double) * std::max(S->Arity, 1u);
+  std::string Carry;
+  uint64_t Seq = 0;
+  std::vector<char> Buf(RowBlockSize);
+  while (true) {
+    size_t N = fread(Buf.data(), 1, Buf.size(), In);
+    bool Last = N == 0;
+
+    RowBlock *B = new RowBlock();
+    B->Seq = Seq++;
+    B->BadRows = 0;
+    B->Data.swap(Carry);
+    B->Data.append(Buf.data(), N);
+    if (!Last) {
+      size_t Cut;
+      if (RowsBinary) {
+        Cut = B->Data.size() - B->Data.size() % RowBytes;
+      } else {
+        size_t NL = B->Data.rfind('\n');
+        Cut = NL == std::string::npos ? 0 : NL + 1;
+      }
+      Carry.assign(B->Data, Cut, std::string::npos);
+      B->Data.resize(Cut);
+    }
+
+    std::unique_lock<std::mutex> Guard(S->Lock);
+    while (S->InFlight >= S->MaxInFlight)
+      S->Changed.wait(Guard);
+    ++S->InFlight;
+    S->Todo.push_back(B);
+    if (Last)
+      S->EndOfInput = true;
+    S->Changed.notify_all();
+    if (Last)
+      return;
+  }
+}
+
+/// RunRows - Compile the -rows function into a row loop and stream the row
+/// input through it.  Results are written in input order no matter which
+/// worker finishes first.
+static bool RunRows(RowBatchFn Fn, unsigned Arity) {
+  FILE *In = RowsInput == "-" ? stdin : fopen(RowsInput.c_str(), "rb");
+  if (!In) {
+    fprintf(stderr, "Error: can't open %s\n", RowsInput.c_str());
+    return false;
+  }
+  FILE *Out = RowsOutput == "-" ? stdout : fopen(RowsOutput.c_str(), "wb");
+  if (!Out) {
+    fprintf(stderr, "Error: can't open %s\n", RowsOutput.c_str());
+    if (In != stdin)
+      fclose(In);
+    return false;
+  }
+
+  RowStream S;
+  S.Fn = Fn;
+  S.Arity = Arity;
+  S.EndOfInput = false;
+  S.InFlight = 0;
+  unsigned Threads = RowsThreads ? RowsThreads
+                                 : std::thread::hardware_concurrency();
+  Threads = std::max(Threads, 1u);
+  S.MaxInFlight = 2 * Threads + 2;
+
+  std::vector<std::thread> Workers;
+  for (unsigned i = 0; i != Threads; ++i)
+    Workers.push_back(std::thread(RowWorker, &S));
+  std::thread Reader(RowReader, &S, In);
+
+  // Write results in order as they become available.
+  unsigned BadRows = 0;
+  for (uint64_t Next = 0;; ++Next) {
+    RowBlock *B;
+    bool Last;
+    {
+      std::unique_lock<std::mutex> Guard(S.Lock);
+      while (!S.Done.count(Next))
+        S.Changed.wait(Guard);
+      B = S.Done[Next];
+      S.Done.erase(Next);
+      --S.InFlight;
+      Last = S.EndOfInput && S.Todo.empty() && S.Done.empty() &&
+             S.InFlight == 0;
+      S.Changed.notify_all();
+    }
+    fwrite(B->Output.data(), 1, B->Output.size(), Out);
+    BadRows += B->BadRows;
+    delete B;
+    if (Last)
+      break;
+  }
+  fflush(Out);
+
+  Reader.join();
+  for (unsigned i = 0; i != Threads; ++i)
+    Workers[i].join();
+  if (In != stdin)
+    fclose(In);
+  if (Out != stdout)
+    fclose(Out);
+
+  if (BadRows)
+    fprintf(stderr, "Warning: %u malformed row(s) evaluated as NaN\n",
+            BadRows);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Sharded Row Evaluation
+//===----------------------------------------------------------------------===//
+
+// With -rows-shards, this process becomes a coordinator: it reads and
+// formats rows as usual, but each block is evaluated by one of several worker
+// processes.  The reader, the ordering of results and the writer are the
+// ones RunRows already has; one worker thread per shard forwards its blocks
+// to a shard and waits for the results.  Shards talk to the coordinator
+// through RowTransport.  The local transport forks the shards after the
+// program has been compiled, so they inherit the compiled code instead of
+// being sent it; a transport to another machine would instead send the
+// program source (or -code-cache entries) when it connects.
+
+static cl::opt<unsigned>
+RowsShards("rows-shards", cl::init(0),
+           cl::desc("Evaluate -rows in this many worker processes "
+                    "(0 = in this process)"));
+
+/// RowTransport - A connection to one shard.
+class RowTransport {
+public:
+  virtual ~RowTransport() {}
+  /// Evaluate - Have the shard evaluate Count rows of In, storing its Count
+  /// results in Out.  Returns false if the shard can't be reached.
+  virtual bool Evaluate(const double *In, double *Out, uint64_t Count) = 0;
+  virtual std::string getName() const = 0;
+};
+
+/// ReadFully - Read exactly Size bytes from FD.
+static bool ReadFully(int FD, void *Buf, size_t Size) {
+  char *P = (char *)Buf;
+  while (Size) {
+    ssize_t N = read(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+/// WriteFully - Write exactly Size bytes to FD.
+static bool WriteFully(int FD, const void *Buf, size_t Size) {
+  const char *P = (const char *)Buf;
+  while (Size) {
+    ssize_t N = write(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+/// PipeTransport - A shard running as a child process, connected by a pair
+/// of pipes.  Each request is a uint64_t row count followed by the packed
+/// rows; the reply is one double per row.
+class PipeTransport : public RowTransport {
+  pid_t Pid;
+  int ToShard, FromShard;
+  unsigned Arity;
+
+  PipeTransport(pid_t pid, int to, int from, unsigned arity)
+    : Pid(pid), ToShard(to), FromShard(from), Arity(arity) {}
+
+  static void RunShard(int In, int Out, RowBatchFn Fn, unsigned Arity) {
+    std::vector<double> Rows, Results;
+    uint64_t Count;
+    while (ReadFully(In, &Count, sizeof(Count))) {
+      Rows.resize(Count * Arity);
+      Results.resize(Count);
+      if (!ReadFully(In, Rows.data(), Rows.size() * sizeof(double)))
+        break;
+      Fn(Rows.data(), Results.data(), Count);
+      if (!WriteFully(Out, Results.data(), Count * sizeof(double)))
+        break;
+    }
+    _exit(0);
+  }
+
+public:
+  /// Spawn - Fork a shard that evaluates rows with Fn.  Inherited is the
+  /// list of descriptors the coordinator holds for other shards; the child
+  /// closes them so that every shard sees end of input when the coordinator
+  /// closes its end.
+  static PipeTransport *Spawn(RowBatchFn Fn, unsigned Arity,
+                              const std::vector<int> &Inherited) {
+    int Down[2], Up[2];
+    if (pipe(Down) != 0)
+      return 0;
+    if (pipe(Up) != 0) {
+      close(Down[0]);
+      close(Down[1]);
+      return 0;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t Pid = fork();
+    if (Pid == 0) {
+      close(Down[1]);
+      close(Up[0]);
+      for (unsigned i = 0, e = Inherited.size(); i != e; ++i)
+        close(Inherited[i]);
+      RunShard(Down[0], Up[1], Fn, Arity);
+    }
+    close(Down[0]);
+    close(Up[1]);
+    if (Pid < 0) {
+      close(Down[1]);
+      close(Up[0]);
+      return 0;
+    }
+    return new PipeTransport(Pid, Down[1], Up[0], Arity);
+  }
+
+  ~PipeTransport() {
+    close(ToShard);
+    close(FromShard);
+    waitpid(Pid, 0, 0);
+  }
+
+  virtual bool Evaluate(const double *In, double *Out, uint64_t Count) {
+    // The shard reads the whole request before replying, so writing it all
+    // before reading can't deadlock.
+    return WriteFully(ToShard, &Count, sizeof(Count)) &&
+           WriteFully(ToShard, In, Count * Arity * sizeof(double)) &&
+           ReadFully(FromShard, Out, Count * sizeof(double));
+  }
+
+  virtual std::string getName() const {
+    return "process " + std::to_string((int)Pid);
+  }
+
+  int getToShard() const { return ToShard; }
+  int getFromShard() const { return FromShard; }
+};
+
+/// IdleShards - The shards not currently evaluating a block.  There is one
+/// RunRows worker thread per shard, so a thread only waits for one once a
+/// shard has failed.  LiveShards counts the shards that haven't.
+static std::mutex ShardLock;
+static std::condition_variable ShardIdle;
+static std::vector<RowTransport*> IdleShards;
+static std::vector<RowTransport*> AllShards;
+static unsigned LiveShards;
+
+/// ShardLocalFn - Evaluates blocks whose shard has failed.
+static RowBatchFn ShardLocalFn;
+
+/// ShardedRowBatch - A RowBatchFn that hands the block to an idle shard.
+/// Once a shard has failed there are more callers than shards, and the extra
+/// ones wait their turn; if every shard has failed, blocks are evaluated
+/// here.
+static void ShardedRowBatch(const double *In, double *Out, uint64_t Count) {
+  RowTransport *T = 0;
+  {
+    std::unique_lock<std::mutex> Guard(ShardLock);
+    while (IdleShards.empty() && LiveShards != 0)
+      ShardIdle.wait(Guard);
+    if (!IdleShards.empty()) {
+      T = IdleShards.back();
+      IdleShards.pop_back();
+    }
+  }
+  if (!T) {
+    ShardLocalFn(In, Out, Count);
+    return;
+  }
+  if (!T->Evaluate(In, Out, Count)) {
+    // The shard is gone; don't lose the block, and don't use it again.
+    fprintf(stderr, "Warning: shard %s failed; evaluating its rows here\n",
+            T->getName().c_str());
+    {
+      std::lock_guard<std::mutex> Guard(ShardLock);
+      --LiveShards;
+    }
+    // Waiters may be left with no shard at all.
+    ShardIdle.notify_all();
+    ShardLocalFn(In, Out, Count);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> Guard(ShardLock);
+    IdleShards.push_back(T);
+  }
+  ShardIdle.notify_one();
+}
+
+/// RunShardedRows - Start RowsShards local shards evaluating rows with Fn and
+/// stream the row input through them.
+static bool RunShardedRows(RowBatchFn Fn, unsigned Arity) {
+  // A shard that dies shouldn't take the coordinator with it.
+  signal(SIGPIPE, SIG_IGN);
+  std::vector<int> Inherited;
+  for (unsigned i = 0; i != RowsShards; ++i) {
+    PipeTransport *T = PipeTransport::Spawn(Fn, Arity, Inherited);
+    if (!T) {
+      perror("Error: can't start shard");
+      break;
+    }
+    Inherited.push_back(T->getToShard());
+    Inherited.push_back(T->getFromShard());
+    AllShards.push_back(T);
+  }
+
+  bool Ok = false;
+  if (!AllShards.empty()) {
+    IdleShards = AllShards;
+    LiveShards = AllShards.size();
+    ShardLocalFn = Fn;
+    RowsThreads = AllShards.size();
+    Ok = RunRows(ShardedRowBatch, Arity);
+  }
+
+  for (unsigned i = 0, e = AllShards.size(); i != e; ++i)
+    delete AllShards[i];
+  AllShards.clear();
+  IdleShards.clear();
+  return Ok;
+}
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" 
+double putchard(double X) {
+  putchar((char)X);
+  return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+extern "C" 
+double printd(double X) {
+  printf("%f\n", X);
+  return 0;
+}
+
+/// InstrCalleeCycles - Cycles spent in instrumented callees of the
+/// innermost instrumented frame on this thread.
+static thread_local uint64_t InstrCalleeCycles;
+
+/// toy_instr_enter - Count a call and start a new frame, returning the
+/// enclosing frame's callee cycles for toy_instr_exit to restore.
+extern "C"
+uint64_t toy_instr_enter(InstrStats *S) {
+  S->Calls.fetch_add(1, std::memory_order_relaxed);
+  uint64_t Saved = InstrCalleeCycles;
+  InstrCalleeCycles = 0;
+  return Saved;
+}
+
+/// toy_instr_exit - Charge a finished frame's time to S, and all of it to
+/// the enclosing frame's callees.
+extern "C"
+void toy_instr_exit(InstrStats *S, uint64_t Start, uint64_t End,
+                    uint64_t Saved) {
+  uint64_t Elapsed = End - Start;
+  uint64_t Self = Elapsed > InstrCalleeCycles ? Elapsed - InstrCalleeCycles
+                                              : 0;
+  S->TotalCycles.fetch_add(Elapsed, std::memory_order_relaxed);
+  S->SelfCycles.fetch_add(Self, std::memory_order_relaxed);
+  InstrCalleeCycles = Saved + Elapsed;
+}
+
+//===----------------------------------------------------------------------===//
+// Mapped arrays: zero-copy views of binary data for arraylen/arrayget.
+//===----------------------------------------------------------------------===//
+
+/// MappedArray - One entry of the table generated code reads arrays through.
+struct MappedArray {
+  const double *Data;
+  uint64_t Length;
+};
+
+/// toy_mapped_arrays - The array table.  Unused entries point at EmptyArray
+/// with a length of zero.
+extern "C" MappedArray toy_mapped_arrays[MaxMappedArrays + 1];
+MappedArray toy_mapped_arrays[MaxMappedArrays + 1];
+static const double EmptyArray = 0.0;
+static unsigned NumMappedArrays;
+
+static void InitMappedArrays() {
+  for (unsigned i = 0; i != MaxMappedArrays + 1; ++i) {
+    toy_mapped_arrays[i].Data = &EmptyArray;
+    toy_mapped_arrays[i].Length = 0;
+  }
+}
+
+/// toy_bind_array - Make Length doubles at Data visible to Kaleidoscope code
+/// without copying them.  The memory must outlive every use.  Returns the
+/// array handle, or -1 if every handle is taken.
+extern "C"
+int toy_bind_array(const double *Data, uint64_t Length) {
+  if (NumMappedArrays == MaxMappedArrays)
+    return -1;
+  if (Length == 0)
+    Data = &EmptyArray;
+  toy_mapped_arrays[NumMappedArrays].Data = Data;
+  toy_mapped_arrays[NumMappedArrays].Length = Length;
+  return NumMappedArrays++;
+}
+
+/// toy_map_array - Memory-map a file of native-endian doubles read-only and
+/// bind it as an array.  A path of the form "shm:NAME" maps the POSIX shared
+/// memory object NAME instead.  The kernel is told the data will be read
+/// sequentially and soon, so it reads ahead aggressively.  Returns the array
+/// handle, or -1 on error.
+extern "C"
+int toy_map_array(const char *Path) {
+  int FD;
+  if (strncmp(Path, "shm:", 4) == 0)
+    FD = shm_open(Path + 4, O_RDONLY, 0);
+  else
+    FD = open(Path, O_RDONLY);
+  if (FD < 0)
+    return -1;
+
+  struct stat St;
+  if (fstat(FD, &St) != 0) {
+    close(FD);
+    return -1;
+  }
+  size_t Size = St.st_size;
+  if (Size < sizeof(double)) {
+    close(FD);
+    return toy_bind_array(0, 0);
+  }
+
+  void *Base = mmap(0, Size, PROT_READ, MAP_SHARED, FD, 0);
+  close(FD);
+  if (Base == MAP_FAILED)
+    return -1;
+  madvise(Base, Size, MADV_SEQUENTIAL);
+  madvise(Base, Size, MADV_WILLNEED);
+
+  int Handle = toy_bind_array((const double *)Base, Size / sizeof(double));
+  if (Handle < 0)
+    munmap(Base, Size);
+  return Handle;
+}
+
+static cl::list<std::string>
+MapArrays("map-array", cl::value_desc("file"),
+          cl::desc("Map a binary file of doubles (or shm:NAME) as the next "
+                   "array handle, starting from 0"));
+
+//===----------------------------------------------------------------------===//
+// Sampling Profiler
+//===----------------------------------------------------------------------===//
+
+// A SIGPROF sampler for finding where JIT'd code spends its time, without
+// root or external tools.  While it runs, an interval timer interrupts the
+// process every so much CPU time, and the signal handler records the
+// interrupted program counter and the return addresses found by walking the
+// frame pointer chain.  The JIT keeps frame pointers for this.  Memory is
+// read with process_vm_readv, which fails cleanly on a bad address instead
+// of faulting, so garbage in the frame pointer register of code built
+// without frame pointers only cuts a stack short.
+//
+// The handler writes into one of two sample buffers.  Once a second a drain
+// thread switches it to the other one and folds the full buffer's stacks into
+// a table of raw addresses, so a long profile doesn't run out of room; the
+// buffers only overflow if more than a buffer's worth of samples arrives in
+// one interval.
+//
+// Samples are turned into names only when they are written out: addresses in
+// JIT'd code map to the function they were emitted for (and a line, if the
+// JIT reported debug locations), and anything else goes through dladdr.  The
+// result is in the folded-stack format flame graph tools read.
+//
+// Sampling is started and stopped with -profile, the profilestart() and
+// profilestop() externs, or SIGUSR2, which toggles it.  When it is off the
+// timer is disarmed and nothing is recorded.
+
+static cl::opt<bool>
+ProfileAtStart("profile", cl::desc("Start the sampling profiler at startup"));
+
+static cl::opt<std::string>
+ProfileOut("profile-out", cl::init("toy.folded"), cl::value_desc("file"),
+           cl::desc("Where to write the profiler's folded stacks at exit"));
+
+static cl::opt<unsigned>
+ProfileHz("profile-hz", cl::init(997),
+          cl::desc("Samples per second of CPU time while profiling"));
+
+static const unsigned MaxProfileDepth = 48;
+static const unsigned MaxProfileSamples = 1 << 14;
+
+namespace {
+struct ProfileSample {
+  std::atomic<unsigned> Depth;
+  uintptr_t PCs[MaxProfileDepth];
+};
+
+/// JITRange - The machine code emitted for one function.
+struct JITRange {
+  uintptr_t End;
+  std::string Name;
+  std::vector<std::pair<uintptr_t, unsigned> > Lines;
+};
+
+/// ProfileListener - Keeps JITRanges up to date as the JIT emits and frees
+/// code.
+class ProfileListener : public JITEventListener {
+public:
+  virtual void NotifyFunctionEmitted(const Function &F, void *Code,
+                                     size_t Size,
+                                     const EmittedFunctionDetails &Details);
+  virtual void NotifyFreeingMachineCode(void *OldPtr);
+};
+} // end anonymous namespace
+
+/// ProfileSamples - The two sample buffers.  They are reserved up front but
+/// only touched, and so only backed by memory, once sampling starts.
+/// ProfileActive is the one the handler fills; ProfileWriters counts the
+/// handlers that may still be writing to each.
+static ProfileSample *ProfileSamples[2];
+static std::atomic<unsigned> ProfileActive;
+static std::atomic<unsigned> ProfileNext[2], ProfileWriters[2];
+static std::atomic<unsigned> ProfileDropped;
+static volatile sig_atomic_t ProfileRunning;
+
+/// RawStacks - Samples collected from the buffers but not yet symbolized,
+/// by stack of addresses, innermost first.
+static std::mutex RawStacksLock;
+static std::map<std::vector<uintptr_t>, uint64_t> RawStacks;
+
+static std::mutex JITRangesLock;
+static std::map<uintptr_t, JITRange> JITRanges;
+static ProfileListener TheProfileListener;
+
+/// FoldedStacks - Samples already symbolized, by folded stack.
+static std::map<std::string, uint64_t> FoldedStacks;
+
+void ProfileListener::NotifyFunctionEmitted(
+    const Function &F, void *Code, size_t Size,
+    const EmittedFunctionDetails &Details) {
+  JITRange R;
+  R.End = (uintptr_t)Code + Size;
+  R.Name = F.getName().empty() ? "<top-level>" : F.getName().str();
+  for (unsigned i = 0, e = Details.LineStarts.size(); i != e; ++i)
+    R.Lines.push_back(std::make_pair(Details.LineStarts[i].Address,
+                                     Details.LineStarts[i].Loc.getLine()));
+  std::lock_guard<std::mutex> Guard(JITRangesLock);
+  JITRanges[(uintptr_t)Code] = R;
+}
+
+void ProfileListener::NotifyFreeingMachineCode(void *OldPtr) {
+  std::lock_guard<std::mutex> Guard(JITRangesLock);
+  JITRanges.erase((uintptr_t)OldPtr);
+}
+
+/// SafeRead - Copy Size bytes from Addr, or return false if they can't be
+/// read.  Async-signal-safe.
+static bool SafeRead(uintptr_t Addr, void *Buf, size_t Size) {
+  iovec Local = { Buf, Size }, Remote = { (void *)Addr, Size };
+  return process_vm_readv(getpid(), &Local, 1, &Remote, 1, 0) ==
+         (ssize_t)Size;
+}
+
+static void HandleProfileSignal(int, siginfo_t *, void *Context) {
+  int SavedErrno = errno;
+  // Announce ourselves as a writer of the active buffer, checking that it
+  // didn't change in between; the drain thread waits for writers to finish.
+  unsigned B;
+  while (true) {
+    B = ProfileActive.load();
+    ProfileWriters[B].fetch_add(1);
+    if (ProfileActive.load() == B)
+      break;
+    ProfileWriters[B].fetch_sub(1);
+  }
+  unsigned Idx = ProfileNext[B].fetch_add(1, std::memory_order_relaxed);
+  if (Idx >= MaxProfileSamples) {
+    ProfileDropped.fetch_add(1, std::memory_order_relaxed);
+    ProfileWriters[B].fetch_sub(1);
+    errno = SavedErrno;
+    return;
+  }
+
+  const mcontext_t &MC = ((ucontext_t *)Context)->uc_mcontext;
+#if defined(__x86_64__)
+  uintptr_t PC = MC.gregs[REG_RIP], FP = MC.gregs[REG_RBP];
+#elif defined(__aarch64__)
+  uintptr_t PC = MC.pc, FP = MC.regs[29];
+#else
+  uintptr_t PC = 0, FP = 0;
+#endif
+  ProfileSample &S = ProfileSamples[B][Idx];
+  unsigned Depth = 0;
+  S.PCs[Depth++] = PC;
+  while (Depth != MaxProfileDepth && FP) {
+    // A frame starts with the caller's frame pointer and return address.
+    uintptr_t Frame[2];
+    if (!SafeRead(FP, Frame, sizeof(Frame)) || Frame[1] == 0)
+      break;
+    // Point into the call instruction, not after it.
+    S.PCs[Depth++] = Frame[1] - 1;
+    if (Frame[0] <= FP)
+      break;  // Stacks grow down, so callers' frames are higher.
+    FP = Frame[0];
+  }
+  S.Depth.store(Depth, std::memory_order_release);
+  ProfileWriters[B].fetch_sub(1);
+  errno = SavedErrno;
+}
+
+/// SetProfileTimer - Arm or disarm the SIGPROF timer.  Async-signal-safe.
+static void SetProfileTimer(bool On) {
+  itimerval T;
+  memset(&T, 0, sizeof(T));
+  if (On) {
+    T.it_interval.tv_usec = 1000000 / std::max(1u, (unsigned)ProfileHz);
+    if (T.it_interval.tv_usec == 0)
+      T.it_interval.tv_usec = 1;
+    T.it_value = T.it_interval;
+  }
+  setitimer(ITIMER_PROF, &T, 0);
+  ProfileRunning = On;
+}
+
+static void HandleProfileToggle(int) {
+  int SavedErrno = errno;
+  SetProfileTimer(!ProfileRunning);
+  errno = SavedErrno;
+}
+
+/// SymbolizePC - The name of the function containing PC.
+static std::string SymbolizePC(uintptr_t PC) {
+  {
+    std::lock_guard<std::mutex> Guard(JITRangesLock);
+    std::map<uintptr_t, JITRange>::iterator I = JITRanges.upper_bound(PC);
+    if (I != JITRanges.begin() && PC < (--I)->second.End) {
+      const JITRange &R = I->second;
+      unsigned Line = 0;
+      for (unsigned i = 0, e = R.Lines.size(); i != e; ++i)
+        if (R.Lines[i].first <= PC)
+          Line = R.Lines[i].second;
+      if (!Line)
+        return R.Name;
+      return R.Name + ":" + std::to_string(Line);
+    }
+  }
+
+  Dl_info Info;
+  if (!dladdr((void *)PC, &Info) || !Info.dli_sname)
+    return "[unknown]";
+  // Definitions loaded from the code cache go by their own names.
+  for (std::map<Function*, std::pair<std::string, uint64_t> >::iterator
+       I = CachedSymbols.begin(), E = CachedSymbols.end(); I != E; ++I)
+    if (I->second.first == Info.dli_sname)
+      return I->first->getName().str();
+  int Status;
+  char *Demangled = abi::__cxa_demangle(Info.dli_sname, 0, 0, &Status);
+  std::string Name = Demangled ? Demangled : Info.dli_sname;
+  free(Demangled);
+  return Name;
+}
+
+/// CollectProfileSamples - Switch the handler to the other buffer, then move
+/// the samples in this one into RawStacks.  Call with RawStacksLock held.
+static void CollectProfileSamples() {
+  unsigned B = ProfileActive.load();
+  ProfileActive.store(1 - B);
+  while (ProfileWriters[B].load() != 0)
+    std::this_thread::yield();
+
+  unsigned Taken = std::min(ProfileNext[B].load(), MaxProfileSamples);
+  for (unsigned i = 0; i != Taken; ++i) {
+    ProfileSample &S = ProfileSamples[B][i];
+    unsigned Depth = S.Depth.load(std::memory_order_acquire);
+    if (!Depth)
+      continue;
+    ++RawStacks[std::vector<uintptr_t>(S.PCs, S.PCs + Depth)];
+    S.Depth.store(0, std::memory_order_relaxed);
+  }
+  ProfileNext[B] = 0;
+}
+
+/// ProfileDrainer - The drain thread: empty the buffers while sampling is on,
+/// and say so the first time samples had to be dropped anyway.
+static void ProfileDrainer() {
+  bool Warned = false;
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    if (!ProfileRunning)
+      continue;
+    {
+      std::lock_guard<std::mutex> Guard(RawStacksLock);
+      CollectProfileSamples();
+    }
+    if (!Warned && ProfileDropped.load()) {
+      fprintf(stderr, "Warning: profiler dropped samples; lower -profile-hz\n");
+      Warned = true;
+    }
+  }
+}
+
+/// DrainProfileSamples - Fold every sample taken so far into FoldedStacks.
+/// Symbolizing looks at the JIT's state, so this runs on the main thread.
+static void DrainProfileSamples() {
+  std::lock_guard<std::mutex> Guard(RawStacksLock);
+  // Once for each buffer.
+  CollectProfileSamples();
+  CollectProfileSamples();
+  for (std::map<std::vector<uintptr_t>, uint64_t>::iterator
+       I = RawStacks.begin(), E = RawStacks.end(); I != E; ++I) {
+    // Folded stacks list the outermost frame first.
+    std::string Stack;
+    for (unsigned d = I->first.size(); d-- != 0;) {
+      std::string Name = SymbolizePC(I->first[d]);
+      std::replace(Name.begin(), Name.end(), ';', ':');
+      std::replace(Name.begin(), Name.end(), ' ', '_');
+      if (!Stack.empty())
+        Stack += ';';
+      Stack += Name;
+    }
+    FoldedStacks[Stack] += I->second;
+  }
+  RawStacks.clear();
+}
+
+/// profilestart - Start sampling.
+extern "C"
+double profilestart() {
+  if (ProfileSamples[0])
+    SetProfileTimer(true);
+  return 0;
+}
+
+/// profilestop - Stop sampling and fold what has been collected.
+extern "C"
+double profilestop() {
+  if (ProfileSamples[0]) {
+    SetProfileTimer(false);
+    DrainProfileSamples();
+  }
+  return 0;
+}
+
+/// InitProfiler - Reserve the sample buffers, install the signal handlers and
+/// start the drain thread.  The JIT event listener is registered separately,
+/// once the JIT exists.
+static void InitProfiler() {
+  void *Map = mmap(0, 2 * sizeof(ProfileSample) * MaxProfileSamples,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (Map == MAP_FAILED)
+    return;
+  ProfileSamples[0] = (ProfileSample *)Map;
+  ProfileSamples[1] = ProfileSamples[0] + MaxProfileSamples;
+
+  struct sigaction SA;
+  memset(&SA, 0, sizeof(SA));
+  SA.sa_sigaction = HandleProfileSignal;
+  SA.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigaction(SIGPROF, &SA, 0);
+  signal(SIGUSR2, HandleProfileToggle);
+
+  std::thread(ProfileDrainer).detach();
+  if (ProfileAtStart)
+    SetProfileTimer(true);
+}
+
+/// FinishProfile - Stop sampling and write out the folded stacks, if any.
+static void FinishProfile() {
+  if (!ProfileSamples[0])
+    return;
+  SetProfileTimer(false);
+  DrainProfileSamples();
+  if (FoldedStacks.empty())
+    return;
+
+  FILE *F = fopen(ProfileOut.c_str(), "w");
+  if (!F) {
+    perror(ProfileOut.c_str());
+    return;
+  }
+  uint64_t Total = 0;
+  for (std::map<std::string, uint64_t>::iterator I = FoldedStacks.begin(),
+       E = FoldedStacks.end(); I != E; ++I) {
+    fprintf(F, "%s %llu\n", I->first.c_str(), (unsigned long long)I->second);
+    Total += I->second;
+  }
+  fclose(F);
+  fprintf(stderr, "Wrote %llu profile samples to %s", (unsigned long long)Total,
+          ProfileOut.c_str());
+  if (unsigned Dropped = ProfileDropped.load())
+    fprintf(stderr, " (%u dropped; lower -profile-hz)", Dropped);
+  fprintf(stderr, "\n");
+}
+
+//===----------------------------------------------------------------------===//
+// Batch Interpreter
+//===----------------------------------------------------------------------===//
+
+// The batch interpreter walks the AST once per batch of rows instead of once
+// per row.  Every node produces a whole column of results, so the cost of
+// dispatching on the node is spread over BatchWidth rows and the arithmetic
+// runs in vector kernels.  It covers the side-effect free core of the
+// language: numbers, variables, the builtin operators, if/then/else, and
+// calls to definitions, double-only externs and the array builtins.
+// Anything else (for, var, assignment) makes isBatchable return false and
+// is left to the JIT.
+
+/// BatchWidth - The number of rows evaluated together.
+static const unsigned BatchWidth = 256;
+
+/// BatchColumnPool - This thread's scratch columns of BatchWidth doubles,
+/// and how many of them are in use.  Recursion is the only loop construct in
+/// the batchable subset, so a few columns per AST level would soon overflow
+/// a row worker's stack; they come from here instead.
+static thread_local std::vector<std::unique_ptr<double[]> > BatchColumnPool;
+static thread_local unsigned BatchColumnsUsed;
+
+namespace {
+/// BatchEnv - The variables in scope: one column of N values per variable.
+struct BatchEnv {
+  unsigned N;
+  std::map<std::string, const double*> Columns;
+};
+
+/// BatchScratch - Hands out columns from BatchColumnPool and gives back all
+/// of them when it goes out of scope.  Scopes nest, so the pool is used as a
+/// stack; each column is allocated separately and never moves.
+class BatchScratch {
+  unsigned Mark;
+public:
+  BatchScratch() : Mark(BatchColumnsUsed) {}
+  ~BatchScratch() { BatchColumnsUsed = Mark; }
+
+  double *column() {
+    if (BatchColumnsUsed == BatchColumnPool.size())
+      BatchColumnPool.push_back(
+        std::unique_ptr<double[]>(new double[BatchWidth]));
+    return BatchColumnPool[BatchColumnsUsed++].get();
+  }
+};
+} // end anonymous namespace
+
+// Four doubles at a time: SSE2 or AVX on x86, NEON pairs on ARM.
+typedef double BatchVec __attribute__((vector_size(4 * sizeof(double))));
+typedef int64_t BatchMask __attribute__((vector_size(4 * sizeof(double))));
+static const unsigned BatchVecWidth = 4;
+
+struct BatchAdd {
+  static BatchVec apply(BatchVec A, BatchVec B) { return A + B; }
+  static double apply(double A, double B) { return A + B; }
+};
+struct BatchSub {
+  static BatchVec apply(BatchVec A, BatchVec B) { return A - B; }
+  static double apply(double A, double B) { return A - B; }
+};
+struct BatchMul {
+  static BatchVec apply(BatchVec A, BatchVec B) { return A * B; }
+  static double apply(double A, double B) { return A * B; }
+};
+/// BatchLess - The codegen for '<' compares unordered-or-less-than, so NaN
+/// operands produce 1.0; !(A >= B) matches that.
+struct BatchLess {
+  static BatchVec apply(BatchVec A, BatchVec B) {
+    const BatchVec One = { 1.0, 1.0, 1.0, 1.0 };
+    BatchMask M = ~(A >= B);
+    return (BatchVec)(M & (BatchMask)One);
+  }
+  static double apply(double A, double B) { return !(A >= B) ? 1.0 : 0.0; }
+};
+
+/// BatchKernel - Out[i] = Op(A[i], B[i]) for N elements, a vector at a time.
+template <typename Op>
+static void BatchKernel(const double *A, const double *B, double *Out,
+                        unsigned N) {
+  unsigned i = 0;
+  for (; i + BatchVecWidth <= N; i += BatchVecWidth) {
+    BatchVec VA, VB;
+    memcpy(&VA, A + i, sizeof(VA));
+    memcpy(&VB, B + i, sizeof(VB));
+    BatchVec R = Op::apply(VA, VB);
+    memcpy(Out + i, &R, sizeof(R));
+  }
+  for (; i != N; ++i)
+    Out[i] = Op::apply(A[i], B[i]);
+}
+
+/// BatchCheckActive - Definitions whose batchability is being decided, so
+/// that recursive definitions don't recurse forever.
+static std::set<const FunctionAST*> BatchCheckActive;
+
+/// isBatchableDef - Return true if F's body can be evaluated in batches.
+static bool isBatchableDef(const FunctionAST *F) {
+  if (BatchCheckActive.count(F))
+    return true;
+  BatchCheckActive.insert(F);
+  bool Result = F->getBody()->isBatchable();
+  BatchCheckActive.erase(F);
+  return Result;
+}
+
+/// EvalBatchDef - Evaluate definition F for N rows with the given argument
+/// columns.
+static void EvalBatchDef(const FunctionAST *F,
+                         const std::vector<const double*> &ArgCols,
+                         unsigned N, double *Out) {
+  BatchEnv Env;
+  Env.N = N;
+  const std::vector<std::string> &Names = F->getProto()->getArgs();
+  for (unsigned i = 0, e = Names.size(); i != e; ++i)
+    Env.Columns[Names[i]] = ArgCols[i];
+  F->getBody()->EvalBatch(Env, Out);
+}
+
+/// EvalBatchSubset - Evaluate E for the rows of Env listed in Rows only,
+/// scattering the results back into Out.  This is how if/then/else runs each
+/// arm on just the rows that take it.
+static void EvalBatchSubset(const ExprAST *E, const BatchEnv &Env,
+                            const unsigned *Rows, unsigned Count,
+                            double *Out) {
+  BatchScratch Scratch;
+  BatchEnv Sub;
+  Sub.N = Count;
+  for (std::map<std::string, const double*>::const_iterator
+       I = Env.Columns.begin(), IE = Env.Columns.end(); I != IE; ++I) {
+    double *Col = Scratch.column();
+    for (unsigned i = 0; i != Count; ++i)
+      Col[i] = I->second[Rows[i]];
+    Sub.Columns[I->first] = Col;
+  }
+
+  double *Result = Scratch.column();
+  E->EvalBatch(Sub, Result);
+  for (unsigned i = 0; i != Count; ++i)
+    Out[Rows[i]] = Result[i];
+}
+
+bool NumberExprAST::isBatchable() const { return true; }
+
+void NumberExprAST::EvalBatch(const BatchEnv &Env, double *Out) const {
+  std::fill(Out, Out + Env.N, Val);
+}
+
+bool VariableExprAST::isBatchable() const { return true; }
+
+void VariableExprAST::EvalBatch(const BatchEnv &Env, double *Out) const {
+  std::map<std::string, const double*>::const_iterator I =
+    Env.Columns.find(Name);
+  if (I == Env.Columns.end())
+    std::fill(Out, Out + Env.N, std::numeric_limits<double>::quiet_NaN());
+  else
+    std::copy(I->second, I->second + Env.N, Out);
+}
+
+bool UnaryExprAST::isBatchable() const {
+  std::map<std::string, FunctionAST*>::const_iterator I =
+    Definitions.find(std::string("unary") + Opcode);
+  if (I == Definitions.end() || !Operand->isBatchable())
+    return false;
+  BatchDef = I->second;
+  return isBatchableDef(BatchDef);
+}
+
+void UnaryExprAST::EvalBatch(const BatchEnv &Env, double *Out) const {
+  BatchScratch Scratch;
+  double *Operands = Scratch.column();
+  Operand->EvalBatch(Env, Operands);
+  std::vector<const double*> ArgCols(1, Operands);
+  EvalBatchDef(BatchDef, ArgCols, Env.N, Out);
+}
+
+bool BinaryExprAST::isBatchable() const {
+  if (Op == '=' || !LHS->isBatchable() || !RHS->isBatchable())
+    return false;
+  if (Op == '+' || Op == '-' || Op == '*' || Op == '<')
+    return true;
+  std::map<std::string, FunctionAST*>::const_iterator I =
+    Definitions.find(std::string("binary") + Op);
+  if (I == Definitions.end())
+    return false;
+  BatchDef = I->second;
+  return isBatchableDef(BatchDef);
+}
+
+void BinaryExprAST::EvalBatch(const BatchEnv &Env, double *Out) const {
+  BatchScratch Scratch;
+  double *L = Scratch.column(), *R = Scratch.column();
+  LHS->EvalBatch(Env, L);
+  RHS->EvalBatch(Env, R);
+  switch (Op) {
+  case '+': BatchKernel<BatchAdd>(L, R, Out, Env.N); return;
+  case '-': BatchKernel<BatchSub>(L, R, Out, Env.N); return;
+  case '*': BatchKernel<BatchMul>(L, R, Out, Env.N); return;
+  case '<': BatchKernel<BatchLess>(L, R, Out, Env.N); return;
+  default: break;
+  }
+  std::vector<const double*> ArgCols;
+  ArgCols.push_back(L);
+  ArgCols.push_back(R);
+  EvalBatchDef(BatchDef, ArgCols, Env.N, Out);
+}
+
+/// MaxBatchNativeArgs - The most arguments the interpreter passes to an
+/// extern.
+static const unsigned MaxBatchNativeArgs = 4;
+
+bool CallExprAST::isBatchable() const {
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (!Args[i]->isBatchable())
+      return false;
+
+  std::map<std::string, FunctionAST*>::const_iterator I =
+    Definitions.find(Callee);
+  if (I != Definitions.end()) {
+    if (I->second->getProto()->getArgs().size() != Args.size())
+      return false;
+    BatchDef = I->second;
+    return isBatchableDef(BatchDef);
+  }
+
+  Function *F = TheModule->getFunction(Callee);
+  if (!F)
+    return (Callee == "arraylen" && Args.size() == 1) ||
+           (Callee == "arrayget" && Args.size() == 2);
+
+  // Externs are called a row at a time; only plain double ones are handled.
+  FunctionType *FT = F->getFunctionType();
+  if (!F->isDeclaration() || FT->getNumParams() != Args.size() ||
+      Args.size() > MaxBatchNativeArgs || !FT->getReturnType()->isDoubleTy())
+    return false;
+  for (unsigned i = 0, e = FT->getNumParams(); i != e; ++i)
+    if (!FT->getParamType(i)->isDoubleTy())
+      return false;
+  BatchNative = TheExecutionEngine->getPointerToNamedFunction(Callee, false);
+  return BatchNative != 0;
+}
+
+/// BatchArrayIndex - Convert a double to an index the way the generated
+/// code's fptosi does, with anything out of int64 range mapped to -1.
+static int64_t BatchArrayIndex(double V) {
+  if (!(V > -9.2e18 && V < 9.2e18))
+    return -1;
+  return (int64_t)V;
+}
+
+void CallExprAST::EvalBatch(const BatchEnv &Env, double *Out) const {
+  BatchScratch Scratch;
+  std::vector<const double*> ArgCols;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    double *Col = Scratch.column();
+    Args[i]->EvalBatch(Env, Col);
+    ArgCols.push_back(Col);
+  }
+
+  if (BatchDef) {
+    EvalBatchDef(BatchDef, ArgCols, Env.N, Out);
+    return;
+  }
+
+  if (!BatchNative) {
+    // arraylen / arrayget, with the same clamping as the generated code.
+    for (unsigned r = 0; r != Env.N; ++r) {
+      int64_t H = BatchArrayIndex(ArgCols[0][r]);
+      const MappedArray &A =
+        toy_mapped_arrays[(uint64_t)H < MaxMappedArrays ? H : MaxMappedArrays];
+      if (Args.size() == 1) {
+        Out[r] = (double)A.Length;
+      } else {
+        int64_t Idx = BatchArrayIndex(ArgCols[1][r]);
+        Out[r] = (uint64_t)Idx < A.Length
+                   ? A.Data[Idx] : std::numeric_limits<double>::quiet_NaN();
+      }
+    }
+    return;
+  }
+
+  for (unsigned r = 0; r != Env.N; ++r) {
+    switch (Args.size()) {
+    case 0: Out[r] = ((double (*)())BatchNative)(); break;
+    case 1: Out[r] = ((double (*)(double))BatchNative)(ArgCols[0][r]); break;
+    case 2:
+      Out[r] = ((double (*)(double, double))BatchNative)(ArgCols[0][r],
+                                                        ArgCols[1][r]);
+      break;
+    case 3:
+      Out[r] = ((double (*)(double, double, double))BatchNative)(
+                 ArgCols[0][r], ArgCols[1][r], ArgCols[2][r]);
+      break;
+    case 4:
+      Out[r] = ((double (*)(double, double, double, double))BatchNative)(
+                 ArgCols[0][r], ArgCols[1][r], ArgCols[2][r], ArgCols[3][r]);
+      break;
+    }
+  }
+}
+
+bool IfExprAST::isBatchable() const {
+  return Cond->isBatchable() && Then->isBatchable() && Else->isBatchable();
+}
+
+void IfExprAST::EvalBatch(const BatchEnv &Env, double *Out) const {
+  BatchScratch Scratch;
+  double *CondV = Scratch.column();
+  Cond->EvalBatch(Env, CondV);
+
+  // Split the rows by which arm they take.  As in the generated code, a NaN
+  // condition takes the else arm.  One column holds both row lists.
+  static_assert(2 * sizeof(unsigned) <= sizeof(double),
+                "row lists don't fit in a column");
+  unsigned *ThenRows = (unsigned*)Scratch.column();
+  unsigned *ElseRows = ThenRows + BatchWidth;
+  unsigned NumThen = 0, NumElse = 0;
+  for (unsigned i = 0; i != Env.N; ++i) {
+    if (CondV[i] != 0.0 && CondV[i] == CondV[i])
+      ThenRows[NumThen++] = i;
+    else
+      ElseRows[NumElse++] = i;
+  }
+
+  // Only run each arm for its own rows: the arms may recurse, and running
+  // them for every row would never terminate.
+  if (NumElse == 0)
+    Then->EvalBatch(Env, Out);
+  else if (NumThen == 0)
+    Else->EvalBatch(Env, Out);
+  else {
+    EvalBatchSubset(Then, Env, ThenRows, NumThen, Out);
+    EvalBatchSubset(Else, Env, ElseRows, NumElse, Out);
+  }
+}
+
+/// InterpRowsFn - The definition InterpRowBatch evaluates.
+static const FunctionAST *InterpRowsFn;
+
+/// InterpRowBatch - A RowBatchFn that interprets InterpRowsFn instead of
+/// running compiled code.  Rows arrive packed, so each batch is transposed
+/// into one column per argument first.
+static void InterpRowBatch(const double *In, double *Out, uint64_t Count) {
+  unsigned Arity = InterpRowsFn->getProto()->getArgs().size();
+  std::vector<double> Columns(Arity * BatchWidth);
+  std::vector<const double*> ArgCols(Arity);
+  for (unsigned a = 0; a != Arity; ++a)
+    ArgCols[a] = &Columns[a * BatchWidth];
+
+  for (uint64_t Row = 0; Row < Count; Row += BatchWidth) {
+    unsigned N = (unsigned)std::min<uint64_t>(BatchWidth, Count - Row);
+    for (unsigned i = 0; i != N; ++i)
+      for (unsigned a = 0; a != Arity; ++a)
+        Columns[a * BatchWidth + i] = In[(Row + i) * Arity + a];
+    EvalBatchDef(InterpRowsFn, ArgCols, N, Out + Row);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Server Mode
+//===----------------------------------------------------------------------===//
+
+// In server mode the source files are a prelude: it is read and compiled
+// once, then the process forks workers that inherit the JIT'd prelude
+// copy-on-write, so its code pages are shared rather than compiled again in
+// each of them.  A client connects to a Unix socket, sends a program and
+// shuts down its side of the connection; a worker runs the program as if it
+// had been typed at the prompt and everything it prints goes back over the
+// connection.  Each request runs in a child the worker forks for it and
+// throws away afterwards, so whatever a program defines (functions, externs,
+// operator precedences) is private to that request: tenants sharing a worker
+// never see each other's state.  A worker that crashes is replaced by a
+// fresh fork.  A client has -serve-receive-timeout seconds to send its whole
+// program, and a request that runs longer than -serve-request-timeout
+// seconds, of CPU or wall time, is killed and the client told why, so one
+// slow client or runaway program can't hold up the others indefinitely.
+//
+// The parent process is the scheduler.  It reads each request in full,
+// estimates its compile cost by counting tokens, and queues it by priority
+// class and tenant; a program may start with a comment line such as
+//   # tenant=reports priority=interactive
+// to say which.  Classes are served in strict priority order, and within a
+// class, tenants share the workers by deficit round robin on cost, so a
+// tenant sending large definitions can't crowd out the others.  Requests
+// above -serve-bulk-cost are demoted to the bulk class.  A request is turned
+// away at once with an error, rather than queued, when it is larger than
+// -serve-max-cost or its tenant already has -serve-queue-limit requests
+// waiting; clients should take that as a signal to back off.  The selected
+// request and its connection are then handed to an idle worker.
+
+static cl::opt<std::string>
+ServeSocket("serve", cl::value_desc("socket path"),
+            cl::desc("Compile the source files as a prelude, then run "
+                     "programs sent to this Unix socket"));
+
+static cl::opt<unsigned>
+ServeWorkers("serve-workers", cl::init(4),
+             cl::desc("Number of worker processes for -serve"));
+
+static cl::opt<unsigned>
+ServeQueueLimit("serve-queue-limit", cl::init(64),
+                cl::desc("Requests a tenant may have waiting before more "
+                         "are rejected"));
+
+static cl::opt<unsigned>
+ServeMaxCost("serve-max-cost", cl::init(100000),
+             cl::desc("Reject requests with more tokens than this"));
+
+static cl::opt<unsigned>
+ServeBulkCost("serve-bulk-cost", cl::init(2000),
+              cl::desc("Run requests with more tokens than this in the "
+                       "bulk priority class"));
+
+static cl::opt<unsigned>
+ServeReceiveTimeout("serve-receive-timeout", cl::init(10),
+                    cl::desc("Seconds a -serve client has to send its whole "
+                             "program"));
+
+static cl::opt<unsigned>
+ServeRequestTimeout("serve-request-timeout", cl::init(60),
+                    cl::desc("Seconds of CPU or wall time a -serve request "
+                             "may take before it is killed (0 = no limit)"));
+
+/// ServeQuantum - The cost credit a tenant gets per round of the scheduler.
+static const unsigned ServeQuantum = 1000;
+
+/// MaxServeReading - Stop accepting connections while this many requests are
+/// still being received.
+static const unsigned MaxServeReading = 256;
+
+/// MaxServeRequestSize - The longest program a client may send.
+static const size_t MaxServeRequestSize = 16 << 20;
+
+enum ServeClass { serve_interactive, serve_normal, serve_bulk, NumServeClasses };
+
+namespace {
+/// ServeJob - A request: its connection, source and scheduling attributes.
+struct ServeJob {
+  int Conn;
+  std::string Source;
+  std::string Tenant;
+  ServeClass Class;
+  unsigned Cost;
+  uint64_t Received;
+  uint64_t Deadline;  // When an unfinished receive is dropped.
+};
+
+/// TenantQueue - A tenant's waiting jobs in one priority class.
+struct TenantQueue {
+  std::deque<ServeJob*> Jobs;
+  long Deficit;
+  TenantQueue() : Deficit(0) {}
+};
+
+/// ServeClassQueue - The tenants with jobs waiting in one priority class, in
+/// round robin order.
+struct ServeClassQueue {
+  std::map<std::string, TenantQueue> Tenants;
+  std::deque<std::string> Active;
+};
+
+/// ServeWorker - A worker process and the control socket used to send it
+/// jobs.  The worker writes one byte back when it finishes a job.
+struct ServeWorker {
+  pid_t Pid;
+  int Control;
+  bool Busy;
+  uint64_t Received;
+};
+} // end anonymous namespace
+
+static ServeClassQueue ServeQueues[NumServeClasses];
+static std::map<std::string, unsigned> TenantWaiting;
+
+/// ServeStop - Set when the server is asked to shut down.
+static volatile sig_atomic_t ServeStop;
+
+static void HandleServeSignal(int) { ServeStop = 1; }
+
+/// ServeRequest - Run Source with stdout and stderr redirected to Conn.
+static void ServeRequest(int Conn, const std::string &Source) {
+  if (Source.empty())
+    return;
+  FILE *In = fmemopen((void *)Source.data(), Source.size(), "r");
+  if (!In)
+    return;
+
+  fflush(stdout);
+  fflush(stderr);
+  int SavedOut = dup(1), SavedErr = dup(2);
+  dup2(Conn, 1);
+  dup2(Conn, 2);
+
+  ResetLexer(In);
+  fprintf(stderr, "ready> ");
+  getNextToken();
+  MainLoop();
+  ResetLexer(stdin);
+  fclose(In);
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(SavedOut, 1);
+  dup2(SavedErr, 2);
+  close(SavedOut);
+  close(SavedErr);
+}
+
+/// ForkServeRequest - Run Source in a child of this worker and wait for it.
+/// The child starts from the worker's copy of the prelude and is discarded
+/// afterwards, so the definitions, externs and operator precedences a
+/// request makes never reach a later one.
+static void ForkServeRequest(int Conn, const std::string &Source) {
+  // The child counts into the worker's metrics shard rather than claiming
+  // one per request; the worker is idle until it finishes.
+  MetricShard *Shard = &getThreadShard();
+  fflush(stdout);
+  fflush(stderr);
+  pid_t Pid = fork();
+  if (Pid == 0) {
+    ThreadShard = Shard;
+    if (ServeRequestTimeout) {
+      // SIGXCPU at the CPU limit, SIGKILL a second later if it's ignored,
+      // and SIGALRM at the wall clock limit.
+      rlimit RL;
+      RL.rlim_cur = ServeRequestTimeout;
+      RL.rlim_max = ServeRequestTimeout + 1;
+      setrlimit(RLIMIT_CPU, &RL);
+      alarm(ServeRequestTimeout);
+    }
+    ServeRequest(Conn, Source);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+  }
+  if (Pid < 0) {
+    const char Msg[] = "Error: server can't run the request\n";
+    if (send(Conn, Msg, sizeof(Msg) - 1, MSG_NOSIGNAL) < 0) {
+      // The client is gone; nothing more to do.
+    }
+    return;
+  }
+
+  int Status = 0;
+  while (waitpid(Pid, &Status, 0) < 0 && errno == EINTR)
+    ;
+  if (WIFSIGNALED(Status)) {
+    int Sig = WTERMSIG(Status);
+    char Msg[80];
+    int Len;
+    if (ServeRequestTimeout &&
+        (Sig == SIGALRM || Sig == SIGXCPU || Sig == SIGKILL))
+      Len = snprintf(Msg, sizeof(Msg), "Error: program killed after the %u "
+                     "second time limit\n", (unsigned)ServeRequestTimeout);
+    else
+      Len = snprintf(Msg, sizeof(Msg), "Error: program died with signal %d\n",
+                     Sig);
+    if (send(Conn, Msg, Len, MSG_NOSIGNAL) < 0) {
+      // The client is gone; nothing more to do.
+    }
+  }
+}
+
+/// RunServeWorker - A worker's main loop: receive a connection and its
+/// program over Control, run it in a fresh child, and report back.
+static void RunServeWorker(int Control) {
+  // A client that disconnects early makes writes fail with EPIPE rather
+  // than killing the process.
+  signal(SIGPIPE, SIG_IGN);
+  while (1) {
+    uint64_t Len;
+    char CBuf[CMSG_SPACE(sizeof(int))];
+    iovec IOV = { &Len, sizeof(Len) };
+    msghdr Msg;
+    memset(&Msg, 0, sizeof(Msg));
+    Msg.msg_iov = &IOV;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = CBuf;
+    Msg.msg_controllen = sizeof(CBuf);
+    ssize_t N = recvmsg(Control, &Msg, 0);
+    if (N < 0 && errno == EINTR)
+      continue;
+    cmsghdr *CM = N > 0 ? CMSG_FIRSTHDR(&Msg) : 0;
+    if (!CM || CM->cmsg_type != SCM_RIGHTS ||
+        !ReadFully(Control, (char *)&Len + N, sizeof(Len) - N))
+      _exit(0);
+    int Conn;
+    memcpy(&Conn, CMSG_DATA(CM), sizeof(Conn));
+
+    std::string Source(Len, '\0');
+    if (!ReadFully(Control, &Source[0], Len))
+      _exit(0);
+    fcntl(Conn, F_SETFL, fcntl(Conn, F_GETFL) & ~O_NONBLOCK);
+    ForkServeRequest(Conn, Source);
+    close(Conn);
+
+    char Done = 0;
+    if (!WriteFully(Control, &Done, 1))
+      _exit(0);
+  }
+}
+
+/// SpawnServeWorker - Fork a worker.  The child closes every descriptor but
+/// its control socket, so that connections the scheduler closes really close.
+static bool SpawnServeWorker(ServeWorker &W) {
+  int SV[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, SV) != 0)
+    return false;
+  fflush(stdout);
+  fflush(stderr);
+  pid_t Pid = fork();
+  if (Pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    for (int FD = 3, E = sysconf(_SC_OPEN_MAX); FD < E && FD < 65536; ++FD)
+      if (FD != SV[1])
+        close(FD);
+    RunServeWorker(SV[1]);
+  }
+  close(SV[1]);
+  if (Pid < 0) {
+    close(SV[0]);
+    return false;
+  }
+  W.Pid = Pid;
+  W.Control = SV[0];
+  W.Busy = false;
+  return true;
+}
+
+/// RejectJob - Tell the client why its request won't be run, and drop it.
+static void RejectJob(ServeJob *J, const char *Why) {
+  CountMetric(ctr_serve_rejected);
+  std::string Msg = std::string("Error: ") + Why + "\n";
+  if (write(J->Conn, Msg.data(), Msg.size()) < 0) {
+    // The client is gone; nothing more to do.
+  }
+  close(J->Conn);
+  delete J;
+}
+
+/// ParseServeHeader - Read the tenant and priority from the comment line a
+/// program may start with.
+static void ParseServeHeader(ServeJob *J) {
+  J->Tenant = "default";
+  J->Class = serve_normal;
+  if (J->Source.empty() || J->Source[0] != '#')
+    return;
+  std::string Line = J->Source.substr(1, J->Source.find('\n') - 1);
+  for (size_t Pos = 0; Pos < Line.size();) {
+    size_t End = Line.find_first_of(" \t\r", Pos);
+    if (End == std::string::npos)
+      End = Line.size();
+    std::string Word = Line.substr(Pos, End - Pos);
+    if (Word.compare(0, 7, "tenant=") == 0 && Word.size() > 7)
+      J->Tenant = Word.substr(7);
+    else if (Word == "priority=interactive")
+      J->Class = serve_interactive;
+    else if (Word == "priority=normal")
+      J->Class = serve_normal;
+    else if (Word == "priority=bulk")
+      J->Class = serve_bulk;
+    Pos = End + 1;
+  }
+}
+
+/// EstimateCost - The number of tokens in J's program, as a measure of how
+/// much compiling it will take.
+static unsigned EstimateCost(ServeJob *J) {
+  if (J->Source.empty())
+    return 0;
+  FILE *In = fmemopen((void *)J->Source.data(), J->Source.size(), "r");
+  if (!In)
+    return 0;
+  ResetLexer(In);
+  unsigned Cost = 0;
+  while (gettok() != tok_eof)
+    ++Cost;
+  ResetLexer(stdin);
+  fclose(In);
+  return Cost;
+}
+
+/// AdmitJob - Queue a fully read request, or reject it.
+static void AdmitJob(ServeJob *J) {
+  ParseServeHeader(J);
+  J->Cost = EstimateCost(J);
+  if (J->Cost > ServeMaxCost)
+    return RejectJob(J, "request too large");
+  if (TenantWaiting[J->Tenant] >= ServeQueueLimit)
+    return RejectJob(J, "server busy; retry later");
+  if (J->Cost > ServeBulkCost)
+    J->Class = serve_bulk;
+
+  ServeClassQueue &CQ = ServeQueues[J->Class];
+  TenantQueue &TQ = CQ.Tenants[J->Tenant];
+  if (TQ.Jobs.empty())
+    CQ.Active.push_back(J->Tenant);
+  TQ.Jobs.push_back(J);
+  ++TenantWaiting[J->Tenant];
+}
+
+/// PickJob - Take the next job to run, or return null if none are waiting.
+static ServeJob *PickJob() {
+  for (unsigned C = 0; C != NumServeClasses; ++C) {
+    ServeClassQueue &CQ = ServeQueues[C];
+    while (!CQ.Active.empty()) {
+      std::string Tenant = CQ.Active.front();
+      TenantQueue &TQ = CQ.Tenants[Tenant];
+      ServeJob *J = TQ.Jobs.front();
+      if ((long)J->Cost > TQ.Deficit) {
+        // Not enough credit yet: top it up and move to the next tenant.
+        TQ.Deficit += ServeQuantum;
+        CQ.Active.pop_front();
+        CQ.Active.push_back(Tenant);
+        continue;
+      }
+      TQ.Deficit -= J->Cost;
+      TQ.Jobs.pop_front();
+      if (TQ.Jobs.empty()) {
+        CQ.Active.pop_front();
+        CQ.Tenants.erase(Tenant);
+      }
+      if (--TenantWaiting[Tenant] == 0)
+        TenantWaiting.erase(Tenant);
+      return J;
+    }
+  }
+  return 0;
+}
+
+/// SendJob - Hand J's connection and program to worker W.
+static bool SendJob(ServeWorker &W, ServeJob *J) {
+  uint64_t Len = J->Source.size();
+  char CBuf[CMSG_SPACE(sizeof(int))];
+  memset(CBuf, 0, sizeof(CBuf));
+  iovec IOV = { &Len, sizeof(Len) };
+  msghdr Msg;
+  memset(&Msg, 0, sizeof(Msg));
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = CBuf;
+  Msg.msg_controllen = sizeof(CBuf);
+  cmsghdr *CM = CMSG_FIRSTHDR(&Msg);
+  CM->cmsg_level = SOL_SOCKET;
+  CM->cmsg_type = SCM_RIGHTS;
+  CM->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(CM), &J->Conn, sizeof(int));
+
+  ssize_t N = sendmsg(W.Control, &Msg, MSG_NOSIGNAL);
+  bool Ok = N > 0 &&
+            WriteFully(W.Control, (char *)&Len + N, sizeof(Len) - N) &&
+            WriteFully(W.Control, J->Source.data(), J->Source.size());
+  close(J->Conn);
+  delete J;
+  return Ok;
+}
+
+/// RunServer - Compile the prelude that has been read, then schedule client
+/// requests onto ServeWorkers workers until SIGINT or SIGTERM.
+static bool RunServer() {
+  if (ServeSocket.size() >= sizeof(((sockaddr_un*)0)->sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", ServeSocket.c_str());
+    return false;
+  }
+
+  // JIT everything now; code compiled lazily after the fork would be
+  // compiled again in every worker.
+  EmitInLayoutOrder();
+
+  sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  strcpy(Addr.sun_path, ServeSocket.c_str());
+  unlink(Addr.sun_path);
+
+  int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Listener < 0 || bind(Listener, (sockaddr*)&Addr, sizeof(Addr)) < 0 ||
+      listen(Listener, SOMAXCONN) < 0) {
+    perror(ServeSocket.c_str());
+    return false;
+  }
+  fcntl(Listener, F_SETFL, O_NONBLOCK);
+
+  // No SA_RESTART, so that a signal interrupts poll below.
+  struct sigaction SA;
+  memset(&SA, 0, sizeof(SA));
+  SA.sa_handler = HandleServeSignal;
+  sigaction(SIGINT, &SA, 0);
+  sigaction(SIGTERM, &SA, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<ServeWorker> Workers;
+  for (unsigned i = 0; i != ServeWorkers; ++i) {
+    ServeWorker W;
+    if (!SpawnServeWorker(W)) {
+      perror("fork");
+      break;
+    }
+    Workers.push_back(W);
+  }
+  fprintf(stderr, "Serving on %s with %u workers\n", ServeSocket.c_str(),
+          (unsigned)Workers.size());
+
+  // Requests still being received, by connection.
+  std::map<int, ServeJob*> Reading;
+
+  while (!ServeStop && !Workers.empty()) {
+    std::vector<pollfd> FDs;
+    pollfd P = { Listener, POLLIN, 0 };
+    if (Reading.size() < MaxServeReading)
+      FDs.push_back(P);
+    unsigned FirstWorker = FDs.size();
+    for (unsigned i = 0, e = Workers.size(); i != e; ++i) {
+      P.fd = Workers[i].Control;
+      FDs.push_back(P);
+    }
+    unsigned FirstConn = FDs.size();
+    for (std::map<int, ServeJob*>::iterator I = Reading.begin(),
+         E = Reading.end(); I != E; ++I) {
+      P.fd = I->first;
+      FDs.push_back(P);
+    }
+
+    // Wake up in time to drop the first receive that runs out of time.
+    uint64_t Now = MetricNow();
+    int Timeout = -1;
+    for (std::map<int, ServeJob*>::iterator I = Reading.begin(),
+         E = Reading.end(); I != E; ++I) {
+      uint64_t Ms = I->second->Deadline > Now ?
+                    (I->second->Deadline - Now) / 1000000 + 1 : 0;
+      if (Timeout < 0 || Ms < (uint64_t)Timeout)
+        Timeout = Ms;
+    }
+
+    if (poll(FDs.data(), FDs.size(), Timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if (FirstWorker != 0 && FDs[0].revents) {
+      int Conn;
+      while ((Conn = accept(Listener, 0, 0)) >= 0) {
+        fcntl(Conn, F_SETFL, O_NONBLOCK);
+        ServeJob *J = new ServeJob();
+        J->Conn = Conn;
+        J->Deadline = MetricNow() + ServeReceiveTimeout * 1000000000ULL;
+        Reading[Conn] = J;
+      }
+    }
+
+    // A worker reports a finished job, or has died.
+    for (unsigned i = FirstWorker; i != FirstConn; ++i) {
+      if (!FDs[i].revents)
+        continue;
+      ServeWorker &W = Workers[i - FirstWorker];
+      char Done;
+      if (read(W.Control, &Done, 1) == 1) {
+        RecordLatency(hist_request, W.Received);
+        W.Busy = false;
+        continue;
+      }
+      int Status = 0;
+      close(W.Control);
+      waitpid(W.Pid, &Status, 0);
+      if (WIFSIGNALED(Status))
+        fprintf(stderr, "Worker %d died with signal %d; restarting it\n",
+                (int)W.Pid, WTERMSIG(Status));
+      else
+        fprintf(stderr, "Worker %d exited with status %d; restarting it\n",
+                (int)W.Pid, WEXITSTATUS(Status));
+      if (!SpawnServeWorker(W))
+        W.Pid = 0;
+    }
+    for (unsigned i = Workers.size(); i-- != 0;)
+      if (Workers[i].Pid == 0)
+        Workers.erase(Workers.begin() + i);
+
+    for (unsigned i = FirstConn, e = FDs.size(); i != e; ++i) {
+      if (!FDs[i].revents)
+        continue;
+      ServeJob *J = Reading[FDs[i].fd];
+      char Buf[65536];
+      ssize_t N;
+      while ((N = read(J->Conn, Buf, sizeof(Buf))) > 0 &&
+             J->Source.size() <= MaxServeRequestSize)
+        J->Source.append(Buf, N);
+      if (N < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      Reading.erase(J->Conn);
+      if (N < 0) {
+        close(J->Conn);
+        delete J;
+      } else if (J->Source.size() > MaxServeRequestSize) {
+        RejectJob(J, "request too large");
+      } else {
+        J->Received = MetricNow();
+        AdmitJob(J);
+      }
+    }
+
+    // Drop clients that haven't finished sending in time, so that they
+    // can't hold the receive slots and keep the listener from being polled.
+    Now = MetricNow();
+    for (std::map<int, ServeJob*>::iterator I = Reading.begin(),
+         E = Reading.end(); I != E;) {
+      ServeJob *J = I->second;
+      if (J->Deadline > Now) {
+        ++I;
+        continue;
+      }
+      Reading.erase(I++);
+      RejectJob(J, "request not received in time");
+    }
+
+    unsigned Busy = 0;
+    for (unsigned i = 0, e = Workers.size(); i != e; ++i) {
+      if (!Workers[i].Busy)
+        if (ServeJob *J = PickJob()) {
+          Workers[i].Received = J->Received;
+          Workers[i].Busy = SendJob(Workers[i], J);
+        }
+      Busy += Workers[i].Busy;
+    }
+
+    unsigned Queued = 0;
+    for (std::map<std::string, unsigned>::iterator I = TenantWaiting.begin(),
+         E = TenantWaiting.end(); I != E; ++I)
+      Queued += I->second;
+    SetGauge(gauge_serve_queued, Queued);
+    SetGauge(gauge_serve_receiving, Reading.size());
+    SetGauge(gauge_serve_busy, Busy);
+  }
+
+  for (std::map<int, ServeJob*>::iterator I = Reading.begin(),
+       E = Reading.end(); I != E; ++I) {
+    close(I->first);
+    delete I->second;
+  }
+  while (ServeJob *J = PickJob())
+    RejectJob(J, "server shutting down");
+  for (unsigned i = 0, e = Workers.size(); i != e; ++i)
+    kill(Workers[i].Pid, SIGTERM);
+  for (unsigned i = 0, e = Workers.size(); i != e; ++i) {
+    waitpid(Workers[i].Pid, 0, 0);
+    close(Workers[i].Control);
+  }
+  close(Listener);
+  unlink(ServeSocket.c_str());
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Asynchronous Compilation
+//===----------------------------------------------------------------------===//
+
+// Embedders that can't block a request thread on parsing, codegen and JIT
+// submit source units to a compile queue instead, and get back a future for
+// the compiled code.  One compile thread owns the parser, the module and the
+// JIT, and works through the queue in order.  A unit whose definitions call
+// functions that don't exist yet waits, without holding up the queue, until
+// the units defining them have been compiled; so units may be submitted in
+// any order.  User-defined binary operators are the exception: they must be
+// compiled before units that use them are parsed.  A unit with a top-level
+// expression never waits: its caller is about to run it, just as at the
+// prompt, so its callees have to exist already.
+//
+// -async-compile drives the queue from the command line.  The input is split
+// into one unit per item and all of them are submitted up front; the driver
+// then runs each unit's top-level expressions, in order, as soon as that unit
+// has been compiled, while the compile thread carries on with the rest.
+
+namespace {
+/// CompileUnit - A queued unit of source and the promise of its result.
+struct CompileUnit {
+  std::string Source;
+  std::promise<void*> Result;
+  std::vector<PrototypeAST*> Externs;
+  std::vector<FunctionAST*> Defs;
+  /// TopLevel - The addresses of the unit's top-level expressions, in order.
+  /// Units without any get an empty list as soon as they are parsed.
+  std::promise<std::vector<void*> > TopLevel;
+  bool HasTopLevel;
+  CompileUnit() : HasTopLevel(false) {}
+};
+} // end anonymous namespace
+
+static std::mutex CompileQueueLock;
+static std::condition_variable CompileQueueChanged;
+static std::deque<CompileUnit*> CompileQueue;
+static bool CompileQueueStopping;
+static std::thread CompileThread;
+
+/// WaitingUnits - Parsed units whose callees don't all exist yet.  Only the
+/// compile thread touches these.
+static std::vector<CompileUnit*> WaitingUnits;
+
+/// ParseUnit - Parse U's source into externs and definitions.  Top-level
+/// expressions become anonymous definitions.
+static bool ParseUnit(CompileUnit *U) {
+  if (U->Source.empty())
+    return true;
+  FILE *In = fmemopen((void *)U->Source.data(), U->Source.size(), "r");
+  if (!In)
+    return false;
+  ResetLexer(In);
+  getNextToken();
+  bool Ok = true;
+  while (Ok && CurTok != tok_eof) {
+    switch (CurTok) {
+    case ';':
+      getNextToken();
+      break;
+    case tok_export:
+    case tok_def:
+      if (FunctionAST *F = ParseDefinition())
+        U->Defs.push_back(F);
+      else
+        Ok = false;
+      break;
+    case tok_extern:
+      if (PrototypeAST *P = ParseExtern())
+        U->Externs.push_back(P);
+      else
+        Ok = false;
+      break;
+    default:
+      U->HasTopLevel = true;
+      if (FunctionAST *F = ParseTopLevelExpr())
+        U->Defs.push_back(F);
+      else
+        Ok = false;
+      break;
+    }
+  }
+  ResetLexer(stdin);
+  fclose(In);
+  return Ok;
+}
+
+/// isUnitReady - Return true if every function U calls is either in the
+/// module already or declared by U itself.
+static bool isUnitReady(CompileUnit *U) {
+  std::set<std::string> Callees;
+  ProfileCallees = &Callees;
+  for (unsigned i = 0, e = U->Defs.size(); i != e; ++i)
+    U->Defs[i]->Profile();
+  ProfileCallees = 0;
+
+  for (unsigned i = 0, e = U->Externs.size(); i != e; ++i)
+    Callees.erase(U->Externs[i]->getName());
+  for (unsigned i = 0, e = U->Defs.size(); i != e; ++i)
+    Callees.erase(U->Defs[i]->getName());
+  for (std::set<std::string>::iterator I = Callees.begin(), E = Callees.end();
+       I != E; ++I)
+    if (!LookupFunction(*I) && *I != "arraylen" && *I != "arrayget")
+      return false;
+  return true;
+}
+
+/// CompileReadyUnit - Generate code for U and JIT the last function it
+/// defines (or declares, if it only has externs), fulfilling its promise with
+/// the address.  Errors give a null address.  The top-level expressions
+/// compiled before any error are JIT'd as well.
+static void CompileReadyUnit(CompileUnit *U) {
+  Function *Last = 0;
+  std::vector<void*> TopLevel;
+  bool Ok = true;
+  for (unsigned i = 0, e = U->Externs.size(); Ok && i != e; ++i)
+    Ok = (Last = U->Externs[i]->Codegen()) != 0;
+  for (unsigned i = 0, e = U->Defs.size(); Ok && i != e; ++i) {
+    Ok = (Last = U->Defs[i]->Codegen()) != 0;
+    if (!Ok)
+      break;
+    if (!U->Defs[i]->getName().empty())
+      Definitions[U->Defs[i]->getName()] = U->Defs[i];
+    else
+      TopLevel.push_back(TheExecutionEngine->getPointerToFunction(Last));
+  }
+  void *Addr = 0;
+  if (Ok && Last)
+    Addr = TheExecutionEngine->getPointerToFunction(Last);
+  U->Result.set_value(Addr);
+  if (U->HasTopLevel)
+    U->TopLevel.set_value(TopLevel);
+  delete U;
+}
+
+/// CompileOrWait - Compile U if it is ready, otherwise set it aside.  Each
+/// unit compiled may make waiting units ready, so keep going until no more
+/// are.
+static void CompileOrWait(CompileUnit *U) {
+  if (!U->HasTopLevel && !isUnitReady(U)) {
+    WaitingUnits.push_back(U);
+    return;
+  }
+  CompileReadyUnit(U);
+
+  for (bool Progress = true; Progress;) {
+    Progress = false;
+    for (unsigned i = 0, e = WaitingUnits.size(); i != e; ++i)
+      if (isUnitReady(WaitingUnits[i])) {
+        CompileUnit *Ready = WaitingUnits[i];
+        WaitingUnits.erase(WaitingUnits.begin() + i);
+        CompileReadyUnit(Ready);
+        Progress = true;
+        break;
+      }
+  }
+}
+
+/// CompileLoop - The compile thread.
+static void CompileLoop() {
+  while (true) {
+    CompileUnit *U;
+    {
+      std::unique_lock<std::mutex> Guard(CompileQueueLock);
+      while (CompileQueue.empty() && !CompileQueueStopping)
+        CompileQueueChanged.wait(Guard);
+      if (CompileQueue.empty())
+        break;
+      U = CompileQueue.front();
+      CompileQueue.pop_front();
+      SetGauge(gauge_compile_queue, CompileQueue.size());
+    }
+    if (ParseUnit(U)) {
+      if (!U->HasTopLevel)
+        U->TopLevel.set_value(std::vector<void*>());
+      CompileOrWait(U);
+    } else {
+      U->Result.set_value(0);
+      U->TopLevel.set_value(std::vector<void*>());
+      delete U;
+    }
+  }
+
+  // Nothing else is coming, so what is still waiting never will be ready.
+  for (unsigned i = 0, e = WaitingUnits.size(); i != e; ++i) {
+    WaitingUnits[i]->Result.set_value(0);
+    delete WaitingUnits[i];
+  }
+  WaitingUnits.clear();
+}
+
+/// StartCompileQueue - Start the compile thread.  Until StopCompileQueue
+/// returns, all parsing and code generation must go through CompileAsync.
+void StartCompileQueue() {
+  CompileQueueStopping = false;
+  CompileThread = std::thread(CompileLoop);
+}
+
+/// EnqueueUnit - Hand U to the compile thread, which owns it from then on.
+static void EnqueueUnit(CompileUnit *U) {
+  std::lock_guard<std::mutex> Guard(CompileQueueLock);
+  CompileQueue.push_back(U);
+  SetGauge(gauge_compile_queue, CompileQueue.size());
+  CompileQueueChanged.notify_one();
+}
+
+/// CompileAsync - Queue Source for compilation.  The future gives the address
+/// of the last function the source defines, or null if it had errors or its
+/// callees were never defined.  Safe to call from any thread.
+std::future<void*> CompileAsync(const std::string &Source) {
+  CompileUnit *U = new CompileUnit();
+  U->Source = Source;
+  std::future<void*> Result = U->Result.get_future();
+  EnqueueUnit(U);
+  return Result;
+}
+
+/// CompileTopLevelAsync - Queue Source for compilation.  The future gives
+/// the address of each top-level expression in it, in order.
+static std::future<std::vector<void*> >
+CompileTopLevelAsync(const std::string &Source) {
+  CompileUnit *U = new CompileUnit();
+  U->Source = Source;
+  std::future<std::vector<void*> > TopLevel = U->TopLevel.get_future();
+  EnqueueUnit(U);
+  return TopLevel;
+}
+
+/// StopCompileQueue - Finish compiling everything queued, fail the units
+/// that are still waiting for callees, and stop the compile thread.
+void StopCompileQueue() {
+  {
+    std::lock_guard<std::mutex> Guard(CompileQueueLock);
+    CompileQueueStopping = true;
+    CompileQueueChanged.notify_one();
+  }
+  CompileThread.join();
+}
+
+static cl::opt<bool>
+AsyncCompile("async-compile",
+             cl::desc("Compile the input through the asynchronous compile "
+                      "queue, running each top-level expression once its "
+                      "code is ready"));
+
+/// isItemKeyword - Return true if Word starts an item that isn't a top-level
+/// expression.
+static bool isItemKeyword(const std::string &Word) {
+  return Word == "def" || Word == "extern" || Word == "export";
+}
+
+/// SplitItems - Split Source into units of roughly one top-level item each:
+/// a unit ends at a ';' outside parentheses, or where the next 'def',
+/// 'extern' or 'export' starts.  An expression that follows a definition
+/// without a ';' stays in the definition's unit, which is still correct, as
+/// every unit reports its own top-level expressions.
+static void SplitItems(const std::string &Source,
+                       std::vector<std::string> &Units) {
+  std::string Unit, LastWord;
+  bool HasToken = false;  // Anything but blanks, comments and ';' so far.
+  int Depth = 0;
+  for (size_t i = 0, e = Source.size(); i != e; ++i) {
+    char C = Source[i];
+    if (C == '#') {
+      size_t End = std::min(Source.find('\n', i), e);
+      Unit.append(Source, i, End - i);
+      i = End - 1;
+      continue;
+    }
+    if (isalpha(C) && (i == 0 || !isalnum(Source[i - 1]))) {
+      size_t End = i;
+      while (End != e && isalnum(Source[End]))
+        ++End;
+      std::string Word = Source.substr(i, End - i);
+      if (Depth == 0 && HasToken && isItemKeyword(Word) &&
+          !(Word == "def" && LastWord == "export")) {
+        Units.push_back(Unit);
+        Unit.clear();
+      }
+      Unit += Word;
+      LastWord = Word;
+      HasToken = true;
+      i = End - 1;
+      continue;
+    }
+
+    Unit += C;
+    if (C == '(')
+      ++Depth;
+    else if (C == ')' && Depth > 0)
+      --Depth;
+    if (C == ';' && Depth == 0) {
+      if (HasToken)
+        Units.push_back(Unit);
+      Unit.clear();
+      HasToken = false;
+    } else if (!isspace(C)) {
+      HasToken = true;
+      LastWord.clear();
+    }
+  }
+  if (HasToken)
+    Units.push_back(Unit);
+}
+
+/// RunAsyncCompile - Read all of the input, queue it for compilation and run
+/// the top-level expressions in order as their code becomes ready.
+static void RunAsyncCompile() {
+  std::string Source;
+  std::vector<FILE*> Files(1, InputFile);
+  Files.insert(Files.end(), PendingInputs.begin(), PendingInputs.end());
+  for (unsigned i = 0, e = Files.size(); i != e; ++i) {
+    char Buf[4096];
+    size_t N;
+    while ((N = fread(Buf, 1, sizeof(Buf), Files[i])) != 0)
+      Source.append(Buf, N);
+    Source += '\n';  // Keep tokens from running across files.
+    if (Files[i] != stdin)
+      fclose(Files[i]);
+  }
+  ResetLexer(stdin);
+
+  std::vector<std::string> Units;
+  SplitItems(Source, Units);
+
+  // Callees must be compiled on the compile thread, which owns the module,
+  // not lazily by whichever thread first calls them.
+  TheExecutionEngine->DisableLazyCompilation(true);
+  StartCompileQueue();
+  std::vector<std::future<std::vector<void*> > > TopLevel;
+  for (unsigned i = 0, e = Units.size(); i != e; ++i)
+    TopLevel.push_back(CompileTopLevelAsync(Units[i]));
+  for (unsigned i = 0, e = TopLevel.size(); i != e; ++i) {
+    std::vector<void*> Code = TopLevel[i].get();
+    for (unsigned j = 0, je = Code.size(); j != je; ++j) {
+      double (*FP)() = (double (*)())(intptr_t)Code[j];
+      MetricTimer Execute(hist_execute);
+      double Result = FP();
+      Execute.stop();
+      PrintResult(Result);
+    }
+  }
+  StopCompileQueue();
+}
+
+//===----------------------------------------------------------------------===//
+// Pipeline Autotuning
+//===----------------------------------------------------------------------===//
+
+// -autotune-out searches for the pass pipeline that suits a set of
+// representative programs best.  Each candidate is written to a temporary
+// configuration, and every program is run under it in a fresh copy of this
+// executable, which reports its compile and run time back over a pipe.  The
+// search is a simple hill climb from the standard pipeline (or the one given
+// with -pipeline-config): mutate the best configuration so far and keep the
+// result if it is faster.  Since every process starts from scratch, a
+// candidate that crashes or hangs only costs its own score.  The programs
+// also report their results, and a candidate that changes any of them is
+// disqualified however fast it is.
+
+static cl::opt<std::string>
+AutotuneOut("autotune-out", cl::init(""), cl::value_desc("file"),
+            cl::desc("Search for the pass pipeline that compiles and runs "
+                     "the input programs fastest, and write it to <file> "
+                     "for -pipeline-config"));
+
+static cl::opt<unsigned>
+AutotuneIterations("autotune-iterations", cl::init(40),
+                   cl::desc("Number of candidate pipelines to try"));
+
+static cl::opt<unsigned>
+AutotuneRuns("autotune-runs", cl::init(3),
+             cl::desc("Runs of each program per candidate; the fastest "
+                      "counts"));
+
+static cl::opt<double>
+AutotuneCompileWeight("autotune-compile-weight", cl::init(1.0),
+                      cl::desc("How much a second of compile time counts "
+                               "against a second of run time"));
+
+static cl::opt<unsigned>
+AutotuneSeed("autotune-seed", cl::init(1),
+             cl::desc("Seed for the autotuner's choices"));
+
+static cl::opt<unsigned>
+AutotuneTimeout("autotune-timeout", cl::init(60),
+                cl::desc("Seconds before a trial run is abandoned"));
+
+static cl::opt<int>
+ReportTimesFd("report-times-fd", cl::init(-1), cl::Hidden,
+              cl::desc("At exit, write the compile and run time in "
+                       "nanoseconds to this descriptor"));
+
+/// ReportTrialTimes - Tell the autotuner what this run cost.  Everything
+/// since StartNs that wasn't running top-level expressions counts as compile
+/// time.
+static void ReportTrialTimes(uint64_t StartNs) {
+  if (ReportTimesFd < 0)
+    return;
+  uint64_t RunNs = MetricSumNs(hist_execute);
+  uint64_t TotalNs = MetricNow() - StartNs;
+  char Buf[64];
+  int N = snprintf(Buf, sizeof(Buf), "%llu %llu\n",
+                   (unsigned long long)(TotalNs - std::min(TotalNs, RunNs)),
+                   (unsigned long long)RunNs);
+  WriteFully(ReportTimesFd, Buf, N);
+  close(ReportTimesFd);
+}
+
+/// RunSelf - Run this executable with Args, its output discarded, and
+/// collect what it writes to descriptor 3 in Report.  Return false if it
+/// failed, crashed or ran longer than Timeout seconds.
+static bool RunSelf(const std::vector<std::string> &Args, unsigned Timeout,
+                    std::string &Report) {
+  int Fds[2];
+  if (pipe(Fds) != 0)
+    return false;
+  std::vector<const char*> Argv;
+  Argv.push_back("toy");
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    Argv.push_back(Args[i].c_str());
+  Argv.push_back(0);
+
+  fflush(stdout);
+  fflush(stderr);
+  pid_t Pid = fork();
+  if (Pid == 0) {
+    close(Fds[0]);
+    int Null = open("/dev/null", O_RDWR);
+    dup2(Null, 0);
+    dup2(Null, 1);
+    dup2(Null, 2);
+    dup2(Fds[1], 3);
+    // The alarm survives exec and kills a run that takes too long.
+    alarm(Timeout);
+    execv("/proc/self/exe", (char *const *)&Argv[0]);
+    _exit(127);
+  }
+  close(Fds[1]);
+  if (Pid < 0) {
+    close(Fds[0]);
+    return false;
+  }
+
+  Report.clear();
+  char Buf[4096];
+  ssize_t N;
+  while ((N = read(Fds[0], Buf, sizeof(Buf))) > 0 ||
+         (N < 0 && errno == EINTR))
+    if (N > 0)
+      Report.append(Buf, N);
+  close(Fds[0]);
+  int Status;
+  return waitpid(Pid, &Status, 0) == Pid && WIFEXITED(Status) &&
+         WEXITSTATUS(Status) == 0;
+}
+
+/// RunTrial - Run Program once in a fresh process under the configuration in
+/// ConfigPath, and collect the "result" lines of its top-level expressions in
+/// Results.  Return false if it failed, crashed or timed out.
+static bool RunTrial(const std::string &ConfigPath, const std::string &Program,
+                     uint64_t &CompileNs, uint64_t &RunNs,
+                     std::string &Results) {
+  std::vector<std::string> Args;
+  Args.push_back("-pipeline-config=" + ConfigPath);
+  Args.push_back("-report-results-fd=3");
+  Args.push_back("-report-times-fd=3");
+  if (BatchMode)
+    Args.push_back("-batch");
+  Args.push_back(Program);
+
+  std::string Out;
+  if (!RunSelf(Args, AutotuneTimeout, Out))
+    return false;
+  // The results come first, then the times.
+  size_t Times = Out.rfind("result ");
+  Times = Times == std::string::npos ? 0 : Out.find('\n', Times) + 1;
+  unsigned long long C, R;
+  if (sscanf(Out.c_str() + Times, "%llu %llu", &C, &R) != 2)
+    return false;
+  CompileNs = C;
+  RunNs = R;
+  Results = Out.substr(0, Times);
+  return true;
+}
+
+/// ScoreCandidate - The cost of S in weighted nanoseconds, summed over the
+/// programs, or infinity if any of them fails under it.  If Expected is
+/// empty, the programs' results under S are stored there; otherwise a program
+/// whose results differ from them fails too, and sets WrongResults.
+static double ScoreCandidate(const PipelineSettings &S,
+                             const std::vector<std::string> &Programs,
+                             const std::string &ConfigPath,
+                             std::vector<std::string> &Expected,
+                             bool &WrongResults) {
+  const double Failed = std::numeric_limits<double>::infinity();
+  WrongResults = false;
+  if (!WritePipelineConfig(ConfigPath, S))
+    return Failed;
+  bool Reference = Expected.empty();
+  double Score = 0;
+  for (unsigned i = 0, e = Programs.size(); i != e; ++i) {
+    double Best = Failed;
+    for (unsigned r = 0; r != std::max(1U, (unsigned)AutotuneRuns); ++r) {
+      uint64_t CompileNs, RunNs;
+      std::string Results;
+      if (!RunTrial(ConfigPath, Programs[i], CompileNs, RunNs, Results))
+        return Failed;
+      if (Reference && Expected.size() == i)
+        Expected.push_back(Results);
+      if (Results != Expected[i]) {
+        WrongResults = true;
+        return Failed;
+      }
+      Best = std::min(Best, RunNs + AutotuneCompileWeight * CompileNs);
+    }
+    Score += Best;
+  }
+  return Score;
+}
+
+/// MutateCandidate - Make one random change to S.  The first pass stays
+/// mem2reg, since nothing else does much with allocas.
+static void MutateCandidate(PipelineSettings &S, std::mt19937 &Rng) {
+  static const int UnrollCounts[] = { 0, 2, 4, 8 };
+  static const unsigned VectorWidths[] = { 0, 1, 2, 4, 8 };
+  static const int InlineThresholds[] = { -1, 0, 75, 225, 500, 1000 };
+  const unsigned MaxSteps = 16;
+
+  std::vector<PipelineStep> &Steps = S.Steps;
+  unsigned Movable = Steps.size() - 1;
+  switch (Rng() % 5) {
+  case 0: {  // Insert a pass.
+    if (Steps.size() >= MaxSteps)
+      break;
+    PipelineStep Step;
+    Step.Kind = (PipelinePassKind)(1 + Rng() % (NumPipelinePasses - 1));
+    Step.Param = Step.Kind == pp_unroll ? UnrollCounts[Rng() % 4] : 0;
+    Steps.insert(Steps.begin() + 1 + Rng() % (Movable + 1), Step);
+    break;
+  }
+  case 1:  // Remove a pass.
+    if (Movable)
+      Steps.erase(Steps.begin() + 1 + Rng() % Movable);
+    break;
+  case 2:  // Swap two passes.
+    if (Movable >= 2)
+      std::swap(Steps[1 + Rng() % Movable], Steps[1 + Rng() % Movable]);
+    break;
+  case 3: {  // Change an unroll count, or the vector width if there is none.
+    std::vector<unsigned> Unrolls;
+    for (unsigned i = 0, e = Steps.size(); i != e; ++i)
+      if (Steps[i].Kind == pp_unroll)
+        Unrolls.push_back(i);
+    if (Unrolls.empty())
+      S.VectorWidth = VectorWidths[Rng() % 5];
+    else
+      Steps[Unrolls[Rng() % Unrolls.size()]].Param = UnrollCounts[Rng() % 4];
+    break;
+  }
+  case 4:
+    // The inliner only runs over the whole module in -batch mode.
+    if (BatchMode && Rng() % 2)
+      S.InlineThreshold = InlineThresholds[Rng() % 6];
+    else
+      S.VectorWidth = VectorWidths[Rng() % 5];
+    break;
+  }
+}
+
+/// RunAutotune - Tune the pipeline for Programs and write the best one found
+/// to -autotune-out.  Returns the process exit code.
+static int RunAutotune(const std::vector<std::string> &Programs) {
+  if (Programs.empty()) {
+    fprintf(stderr, "-autotune-out needs benchmark programs as input files\n");
+    return 1;
+  }
+
+  PipelineSettings Best = ActivePipeline;
+  if (Best.Steps.empty()) {
+    std::string Err;
+    ParsePipelineSpec("mem2reg,instcombine,reassociate,gvn,simplifycfg",
+                      Best.Steps, Err);
+  }
+  if (Best.Steps[0].Kind != pp_mem2reg) {
+    PipelineStep Mem2Reg = { pp_mem2reg, 0 };
+    Best.Steps.insert(Best.Steps.begin(), Mem2Reg);
+  }
+
+  std::string ConfigPath = AutotuneOut + ".trial";
+  std::vector<std::string> Expected;
+  bool WrongResults;
+  double BestScore = ScoreCandidate(Best, Programs, ConfigPath, Expected,
+                                    WrongResults);
+  if (BestScore == std::numeric_limits<double>::infinity()) {
+    fprintf(stderr, "autotune: the starting pipeline %s on the inputs\n",
+            WrongResults ? "gives varying results" : "fails");
+    unlink(ConfigPath.c_str());
+    return 1;
+  }
+  double BaseScore = BestScore;
+  fprintf(stderr, "autotune: start %s: %.3f ms\n",
+          FormatPipelineSpec(Best.Steps).c_str(), BestScore / 1e6);
+  WritePipelineConfig(AutotuneOut, Best);
+
+  std::mt19937 Rng(AutotuneSeed);
+  for (unsigned i = 0; i != AutotuneIterations; ++i) {
+    PipelineSettings Candidate = Best;
+    for (unsigned m = 0, me = 1 + Rng() % 3; m != me; ++m)
+      MutateCandidate(Candidate, Rng);
+    double Score = ScoreCandidate(Candidate, Programs, ConfigPath, Expected,
+                                  WrongResults);
+    bool Better = Score < BestScore;
+    fprintf(stderr, "autotune: [%u/%u] %s inline=%d width=%u: ", i + 1,
+            (unsigned)AutotuneIterations,
+            FormatPipelineSpec(Candidate.Steps).c_str(),
+            Candidate.InlineThreshold, Candidate.VectorWidth);
+    if (WrongResults)
+      fprintf(stderr, "changed the results\n");
+    else if (Score == std::numeric_limits<double>::infinity())
+      fprintf(stderr, "failed\n");
+    else
+      fprintf(stderr, "%.3f ms%s\n", Score / 1e6, Better ? " (best)" : "");
+    if (Better) {
+      Best = Candidate;
+      BestScore = Score;
+      // Keep the best so far on disk in case the search is interrupted.
+      WritePipelineConfig(AutotuneOut, Best);
+    }
+  }
+  unlink(ConfigPath.c_str());
+
+  char Comment[128];
+  snprintf(Comment, sizeof(Comment),
+           "Tuned: %.3f ms against %.3f ms for the starting pipeline.",
+           BestScore / 1e6, BaseScore / 1e6);
+  if (!WritePipelineConfig(AutotuneOut, Best, Comment))
+    return 1;
+  fprintf(stderr, "autotune: wrote %s (%.1f%% faster than the start)\n",
+          AutotuneOut.c_str(), 100.0 * (1 - BestScore / BaseScore));
+  return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Session Recording and Replay
+//===----------------------------------------------------------------------===//
+
+// -record writes everything the lexer reads to a file, one line at a time,
+// each prefixed with the microseconds since the session started.
+//
+// -replay takes such a recording and runs its source -replay-runs times, each
+// in a fresh copy of this executable, which reports the compile and execute
+// time of every top-level item.  Arrival times are not reproduced: replays
+// run as fast as they can, so that they are repeatable.  The samples can be
+// saved as a baseline, and compared against one with Welch's t-test.  Items
+// that got significantly slower, by more than -replay-threshold, make the
+// replay fail, which is what makes it usable as a regression gate.
+//
+// The flags a session was recorded with are kept in the recording's header,
+// and replays run with them, so that they measure the configuration the
+// session ran under.  Input and mode flags (-record, -serve, -rows and the
+// like) and file names are left out, as are flags whose value was given as a
+// separate word.  A -pipeline or -pipeline-config given to -replay replaces
+// the recorded pipeline, including -adaptive-opt.  Batch mode can't be
+// replayed: it runs everything after the last item has been read, so no item
+// would be charged for it.
+
+static cl::opt<std::string>
+RecordFile("record", cl::init(""), cl::value_desc("file"),
+           cl::desc("Record the session's input, with timing, to <file>"));
+
+static cl::opt<std::string>
+ReplayFile("replay", cl::init(""), cl::value_desc("file"),
+           cl::desc("Replay a recorded session, under the flags it was "
+                    "recorded with, and report per-item compile and execute "
+                    "times"));
+
+static cl::opt<unsigned>
+ReplayRuns("replay-runs", cl::init(10),
+           cl::desc("Number of times to replay the recording"));
+
+static cl::opt<std::string>
+ReplayBaseline("replay-baseline", cl::init(""), cl::value_desc("file"),
+               cl::desc("Compare the replay against a saved baseline and "
+                        "fail on significant regressions"));
+
+static cl::opt<std::string>
+ReplaySaveBaseline("replay-save-baseline", cl::init(""),
+                   cl::value_desc("file"),
+                   cl::desc("Save the replay's samples as a baseline"));
+
+static cl::opt<double>
+ReplayAlpha("replay-alpha", cl::init(0.01),
+            cl::desc("Significance level for -replay-baseline"));
+
+static cl::opt<double>
+ReplayThreshold("replay-threshold", cl::init(5.0),
+                cl::desc("Smallest slowdown, in percent, that counts as a "
+                         "regression"));
+
+static cl::opt<unsigned>
+ReplayTimeout("replay-timeout", cl::init(300),
+              cl::desc("Seconds before a replay run is abandoned"));
+
+static uint64_t RecordStartNs;
+static std::string RecordLine;
+
+/// InitRecording - Open the -record file and note how the session was run.
+static bool InitRecording(int argc, char **argv) {
+  if (RecordFile.empty())
+    return true;
+  RecordOut = fopen(RecordFile.c_str(), "w");
+  if (!RecordOut) {
+    perror(RecordFile.c_str());
+    return false;
+  }
+  fprintf(RecordOut, "# toy session recording\n# args:");
+  for (int i = 1; i < argc; ++i)
+    fprintf(RecordOut, " %s", argv[i]);
+  fprintf(RecordOut, "\n");
+  RecordStartNs = MetricNow();
+  return true;
+}
+
+static void FlushRecordLine() {
+  fprintf(RecordOut, "%llu\t%s\n",
+          (unsigned long long)((MetricNow() - RecordStartNs) / 1000),
+          RecordLine.c_str());
+  // Flush every line so a session that crashes is still recorded.
+  fflush(RecordOut);
+  RecordLine.clear();
+}
+
+/// RecordInput - Called by the lexer for every character it reads.
+static void RecordInput(int C) {
+  if (C == '\n')
+    FlushRecordLine();
+  else
+    RecordLine += (char)C;
+}
+
+static void FinishRecording() {
+  if (!RecordOut)
+    return;
+  if (!RecordLine.empty())
+    FlushRecordLine();
+  fclose(RecordOut);
+  RecordOut = 0;
+}
+
+/// ReportItemTimes - Hand the per-item times to the replay driver.
+static void ReportItemTimes() {
+  if (ReportItemsFd < 0)
+    return;
+  WriteFully(ReportItemsFd, ItemReport.data(), ItemReport.size());
+  close(ReportItemsFd);
+}
+
+namespace {
+/// ItemSample - The cost of one top-level item in one replay.
+struct ItemSample {
+  std::string Kind;
+  double CompileNs, ExecuteNs;
+};
+
+/// ReplaySamples - One vector of item samples per run.
+typedef std::vector<std::vector<ItemSample> > ReplaySamples;
+} // end anonymous namespace
+
+/// ParseItemSamples - Parse "kind compile-ns execute-ns" lines.
+static void ParseItemSamples(const std::string &Text,
+                             std::vector<ItemSample> &Items) {
+  size_t Pos = 0;
+  while (Pos < Text.size()) {
+    size_t End = Text.find('\n', Pos);
+    if (End == std::string::npos)
+      End = Text.size();
+    char Kind[16];
+    double C, E;
+    if (sscanf(Text.substr(Pos, End - Pos).c_str(), "%15s %lf %lf", Kind, &C,
+               &E) == 3) {
+      ItemSample S;
+      S.Kind = Kind;
+      S.CompileNs = C;
+      S.ExecuteNs = E;
+      Items.push_back(S);
+    }
+    Pos = End + 1;
+  }
+}
+
+/// isReplayedFlag - Whether a flag recorded in a session's '# args:' header
+/// should be passed on to the replays.  Name is the flag without its dashes
+/// or value.
+static bool isReplayedFlag(const std::string &Name) {
+  static const char *const Dropped[] = {
+    "record", "replay", "batch", "emit-obj", "rows", "serve", "diff",
+    "autotune-out", "async-compile", "help"
+  };
+  static const char *const DroppedPrefixes[] = {
+    "replay-", "rows-", "serve-", "diff-", "autotune-", "report-"
+  };
+  for (unsigned i = 0; i != array_lengthof(Dropped); ++i)
+    if (Name == Dropped[i])
+      return false;
+  for (unsigned i = 0; i != array_lengthof(DroppedPrefixes); ++i)
+    if (Name.compare(0, strlen(DroppedPrefixes[i]), DroppedPrefixes[i]) == 0)
+      return false;
+  // This invocation's pipeline, if it has one, replaces the recorded one.
+  if (!PipelineSpec.empty() || !PipelineConfig.empty())
+    return Name != "pipeline" && Name != "pipeline-config" &&
+           Name != "adaptive-opt";
+  return true;
+}
+
+/// ParseRecordedArgs - Add the flags in a '# args:' header line that the
+/// replays should run with to Args.
+static void ParseRecordedArgs(const std::string &Line,
+                              std::vector<std::string> &Args) {
+  for (size_t Pos = 7; Pos < Line.size();) {
+    size_t End = Line.find(' ', Pos);
+    if (End == std::string::npos)
+      End = Line.size();
+    std::string Word = Line.substr(Pos, End - Pos);
+    Pos = End + 1;
+    // File names, and values given as separate words, are skipped.
+    if (Word.size() < 2 || Word[0] != '-')
+      continue;
+    size_t NameStart = Word[1] == '-' ? 2 : 1;
+    std::string Name = Word.substr(NameStart, Word.find('=') - NameStart);
+    if (isReplayedFlag(Name))
+      Args.push_back(Word);
+  }
+}
+
+/// ExtractRecording - Write the source recorded in Path to a temporary file
+/// and return its name, or an empty string on failure.  The flags to replay
+/// it with are added to Args.
+static std::string ExtractRecording(const std::string &Path,
+                                    std::vector<std::string> &Args) {
+  FILE *In = fopen(Path.c_str(), "r");
+  if (!In) {
+    perror(Path.c_str());
+    return "";
+  }
+  char Tmp[] = "/tmp/toy-replay-XXXXXX";
+  int FD = mkstemp(Tmp);
+  FILE *Out = FD < 0 ? 0 : fdopen(FD, "w");
+  if (!Out) {
+    perror("replay");
+    fclose(In);
+    return "";
+  }
+  std::string Line;
+  int C;
+  while ((C = getc(In)) != EOF) {
+    if (C != '\n') {
+      Line += (char)C;
+      continue;
+    }
+    size_t Tab = Line.find('\t');
+    if (Line.compare(0, 7, "# args:") == 0)
+      ParseRecordedArgs(Line, Args);
+    else if (!Line.empty() && Line[0] != '#' && Tab != std::string::npos)
+      fprintf(Out, "%s\n", Line.c_str() + Tab + 1);
+    Line.clear();
+  }
+  fclose(In);
+  fclose(Out);
+  return Tmp;
+}
+
+static bool SaveBaseline(const std::string &Path, const ReplaySamples &Runs) {
+  FILE *F = fopen(Path.c_str(), "w");
+  if (!F) {
+    perror(Path.c_str());
+    return false;
+  }
+  fprintf(F, "# toy replay baseline: %s\n", ReplayFile.c_str());
+  for (unsigned r = 0, re = Runs.size(); r != re; ++r) {
+    fprintf(F, "run\n");
+    for (unsigned i = 0, e = Runs[r].size(); i != e; ++i)
+      fprintf(F, "%s %.0f %.0f\n", Runs[r][i].Kind.c_str(),
+              Runs[r][i].CompileNs, Runs[r][i].ExecuteNs);
+  }
+  return fclose(F) == 0;
+}
+
+static bool LoadBaseline(const std::string &Path, ReplaySamples &Runs) {
+  FILE *F = fopen(Path.c_str(), "r");
+  if (!F) {
+    perror(Path.c_str());
+    return false;
+  }
+  char Line[256];
+  std::string Run;
+  while (fgets(Line, sizeof(Line), F)) {
+    if (Line[0] == '#')
+      continue;
+    if (strcmp(Line, "run\n") == 0) {
+      if (!Run.empty() || !Runs.empty()) {
+        Runs.push_back(std::vector<ItemSample>());
+        ParseItemSamples(Run, Runs.back());
+      }
+      Run.clear();
+      continue;
+    }
+    Run += Line;
+  }
+  fclose(F);
+  Runs.push_back(std::vector<ItemSample>());
+  ParseItemSamples(Run, Runs.back());
+  return true;
+}
+
+/// BetaContinuedFraction - The continued fraction in the regularized
+/// incomplete beta function, evaluated with the modified Lentz method.
+static double BetaContinuedFraction(double A, double B, double X) {
+  const double Eps = 3e-14, Tiny = 1e-300;
+  double C = 1, D = 1 - (A + B) * X / (A + 1);
+  if (fabs(D) < Tiny)
+    D = Tiny;
+  D = 1 / D;
+  double H = D;
+  for (int M = 1; M <= 300; ++M) {
+    for (int Odd = 0; Odd != 2; ++Odd) {
+      double AA = Odd ? -(A + M) * (A + B + M) * X / ((A + 2 * M) *
+                                                      (A + 2 * M + 1))
+                      : M * (B - M) * X / ((A + 2 * M - 1) * (A + 2 * M));
+      D = 1 + AA * D;
+      if (fabs(D) < Tiny)
+        D = Tiny;
+      C = 1 + AA / C;
+      if (fabs(C) < Tiny)
+        C = Tiny;
+      D = 1 / D;
+      H *= D * C;
+      if (Odd && fabs(D * C - 1) < Eps)
+        return H;
+    }
+  }
+  return H;
+}
+
+/// IncompleteBeta - The regularized incomplete beta function I_x(a, b).
+static double IncompleteBeta(double A, double B, double X) {
+  if (X <= 0)
+    return 0;
+  if (X >= 1)
+    return 1;
+  double Front = exp(lgamma(A + B) - lgamma(A) - lgamma(B) + A * log(X) +
+                     B * log(1 - X));
+  if (X < (A + 1) / (A + B + 2))
+    return Front * BetaContinuedFraction(A, B, X) / A;
+  return 1 - Front * BetaContinuedFraction(B, A, 1 - X) / B;
+}
+
+static void MeanAndVariance(const std::vector<double> &X, double &Mean,
+                            double &Var) {
+  Mean = 0;
+  for (unsigned i = 0, e = X.size(); i != e; ++i)
+    Mean += X[i];
+  Mean /= X.size();
+  Var = 0;
+  for (unsigned i = 0, e = X.size(); i != e; ++i)
+    Var += (X[i] - Mean) * (X[i] - Mean);
+  Var = X.size() > 1 ? Var / (X.size() - 1) : 0;
+}
+
+/// WelchTTest - The two-sided p-value for X and Y having the same mean,
+/// without assuming they have the same variance.
+static double WelchTTest(const std::vector<double> &X,
+                         const std::vector<double> &Y) {
+  if (X.size() < 2 || Y.size() < 2)
+    return 1;
+  double MX, VX, MY, VY;
+  MeanAndVariance(X, MX, VX);
+  MeanAndVariance(Y, MY, VY);
+  double SX = VX / X.size(), SY = VY / Y.size();
+  if (SX + SY == 0)
+    return MX == MY ? 1 : 0;
+  double T = (MX - MY) / sqrt(SX + SY);
+  double DF = (SX + SY) * (SX + SY) /
+              (SX * SX / (X.size() - 1) + SY * SY / (Y.size() - 1));
+  return IncompleteBeta(DF / 2, 0.5, DF / (DF + T * T));
+}
+
+/// CompareSamples - Test one measurement of one item against the baseline,
+/// print it if it changed significantly, and return true if it regressed.
+static bool CompareSamples(const char *Item, const char *Kind,
+                           const char *Metric,
+                           const std::vector<double> &Base,
+                           const std::vector<double> &Cur) {
+  double MB, VB, MC, VC;
+  MeanAndVariance(Base, MB, VB);
+  MeanAndVariance(Cur, MC, VC);
+  double P = WelchTTest(Base, Cur);
+  double Change = MB ? 100.0 * (MC - MB) / MB : 0;
+  if (P >= ReplayAlpha)
+    return false;
+  bool Regressed = Change > ReplayThreshold;
+  fprintf(stderr, "  %-8s %-7s %-8s %12.3f %12.3f %+8.1f%% %9.2g  %s\n",
+          Item, Kind, Metric, MB / 1e6, MC / 1e6, Change, P,
+          Regressed ? "REGRESSION" : Change < 0 ? "improved" : "");
+  return Regressed;
+}
+
+/// CompareToBaseline - Print the items whose times changed significantly.
+/// Returns true if any regressed.
+static bool CompareToBaseline(const ReplaySamples &Base,
+                              const ReplaySamples &Cur) {
+  fprintf(stderr, "replay: %u runs against %u baseline runs\n",
+          (unsigned)Cur.size(), (unsigned)Base.size());
+  fprintf(stderr, "  %-8s %-7s %-8s %12s %12s %9s %9s\n", "item", "kind",
+          "time", "base (ms)", "now (ms)", "change", "p");
+  bool Regressed = false;
+  unsigned NumItems = Cur[0].size();
+  std::vector<double> BaseTotal[2], CurTotal[2];
+  for (unsigned i = 0; i <= NumItems; ++i) {
+    bool Total = i == NumItems;
+    std::vector<double> B[2], C[2];
+    for (unsigned r = 0, re = Base.size(); r != re; ++r) {
+      double Sum[2] = { 0, 0 };
+      for (unsigned j = Total ? 0 : i, je = Total ? NumItems : i + 1; j != je;
+           ++j) {
+        Sum[0] += Base[r][j].CompileNs;
+        Sum[1] += Base[r][j].ExecuteNs;
+      }
+      B[0].push_back(Sum[0]);
+      B[1].push_back(Sum[1]);
+    }
+    for (unsigned r = 0, re = Cur.size(); r != re; ++r) {
+      double Sum[2] = { 0, 0 };
+      for (unsigned j = Total ? 0 : i, je = Total ? NumItems : i + 1; j != je;
+           ++j) {
+        Sum[0] += Cur[r][j].CompileNs;
+        Sum[1] += Cur[r][j].ExecuteNs;
+      }
+      C[0].push_back(Sum[0]);
+      C[1].push_back(Sum[1]);
+    }
+    char Item[16];
+    snprintf(Item, sizeof(Item), "%u", i);
+    const char *Name = Total ? "total" : Item;
+    const char *Kind = Total ? "" : Cur[0][i].Kind.c_str();
+    Regressed |= CompareSamples(Name, Kind, "compile", B[0], C[0]);
+    Regressed |= CompareSamples(Name, Kind, "execute", B[1], C[1]);
+  }
+  return Regressed;
+}
+
+/// SameItems - Check that two runs replayed the same items.
+static bool SameItems(const std::vector<ItemSample> &A,
+                      const std::vector<ItemSample> &B) {
+  if (A.size() != B.size())
+    return false;
+  for (unsigned i = 0, e = A.size(); i != e; ++i)
+    if (A[i].Kind != B[i].Kind)
+      return false;
+  return true;
+}
+
+/// RunReplay - Replay -replay, save or compare the samples, and return the
+/// process exit code: 1 if anything failed or regressed.
+static int RunReplay() {
+  if (BatchMode) {
+    fprintf(stderr, "-replay can't be combined with -batch, -emit-obj or "
+                    "-rows\n");
+    return 1;
+  }
+
+  std::vector<std::string> Args;
+  std::string Source = ExtractRecording(ReplayFile, Args);
+  if (Source.empty())
+    return 1;
+  if (!Args.empty()) {
+    std::string Flags;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+      Flags += " " + Args[i];
+    fprintf(stderr, "replay: recorded flags:%s\n", Flags.c_str());
+  }
+
+  Args.push_back("-report-items-fd=3");
+  if (!PipelineConfig.empty())
+    Args.push_back("-pipeline-config=" + PipelineConfig);
+  if (!PipelineSpec.empty())
+    Args.push_back("-pipeline=" + PipelineSpec);
+  Args.push_back(Source);
+
+  ReplaySamples Runs;
+  for (unsigned r = 0; r != std::max(1U, (unsigned)ReplayRuns); ++r) {
+    std::string Report;
+    if (!RunSelf(Args, ReplayTimeout, Report)) {
+      fprintf(stderr, "replay: run %u failed; rerun the recording by hand "
+                      "with 'toy %s' to see why\n", r + 1, Source.c_str());
+      return 1;
+    }
+    Runs.push_back(std::vector<ItemSample>());
+    ParseItemSamples(Report, Runs.back());
+    if (!SameItems(Runs.back(), Runs.front())) {
+      fprintf(stderr, "replay: run %u saw different items; the recording "
+                      "doesn't replay deterministically\n", r + 1);
+      return 1;
+    }
+  }
+  unlink(Source.c_str());
+
+  // Without a baseline, summarize the session.
+  double Compile = 0, Execute = 0;
+  for (unsigned r = 0, re = Runs.size(); r != re; ++r)
+    for (unsigned i = 0, e = Runs[r].size(); i != e; ++i) {
+      Compile += Runs[r][i].CompileNs;
+      Execute += Runs[r][i].ExecuteNs;
+    }
+  fprintf(stderr, "replay: %u items, mean compile %.3f ms, execute %.3f ms "
+                  "per run\n", (unsigned)Runs[0].size(),
+          Compile / Runs.size() / 1e6, Execute / Runs.size() / 1e6);
+
+  if (!ReplaySaveBaseline.empty() && !SaveBaseline(ReplaySaveBaseline, Runs))
+    return 1;
+
+  if (ReplayBaseline.empty())
+    return 0;
+  ReplaySamples Base;
+  if (!LoadBaseline(ReplayBaseline, Base))
+    return 1;
+  for (unsigned r = 0, re = Base.size(); r != re; ++r)
+    if (!SameItems(Base[r], Runs[0])) {
+      fprintf(stderr, "replay: %s was recorded from a different session\n",
+              ReplayBaseline.c_str());
+      return 1;
+    }
+  return CompareToBaseline(Base, Runs) ? 1 : 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Differential Testing
+//===----------------------------------------------------------------------===//
+
+// -diff runs every input program under each backend configuration, each in a
+// fresh copy of this executable, and checks that all of them produce the same
+// top-level results as the first one, the reference.  Results are compared
+// bit for bit, unless a backend declares a tolerance in units in the last
+// place, for configurations that are allowed to reassociate floating point.
+// Compile and run times are reported side by side, fastest of -diff-runs.
+//
+// With -rows and -diff-rows-input, the row evaluators are checked instead:
+// the program's -rows function is run over the given rows by the compiled
+// row loop, the reference, and by -rows-interp and -rows-shards, and the
+// result rows are compared after the top-level results.  Text rows are
+// printed with %.17g, which round-trips every number exactly; -rows-binary
+// also keeps NaN payloads.
+
+static cl::opt<bool>
+Diff("diff",
+     cl::desc("Run the input programs under every backend, compare their "
+              "results and report their times"));
+
+static cl::list<std::string>
+DiffBackends("diff-backend", cl::value_desc("name[@ulps]=flags"),
+             cl::desc("A backend for -diff: a name, an optional tolerance in "
+                      "ulps (without one, results must match bit for bit), "
+                      "and the flags that select it.  The first one is the "
+                      "reference.  Replaces the built-in set"));
+
+static cl::opt<unsigned>
+DiffRuns("diff-runs", cl::init(3),
+         cl::desc("Runs of each program per backend; the fastest counts"));
+
+static cl::opt<unsigned>
+DiffTimeout("diff-timeout", cl::init(300),
+            cl::desc("Seconds before a -diff run is abandoned"));
+
+static cl::opt<std::string>
+DiffRowsInput("diff-rows-input", cl::init(""), cl::value_desc("file"),
+              cl::desc("Diff the -rows evaluators over the rows in <file> "
+                       "instead of the default backends"));
+
+/// ReportResults - Hand the top-level results to the -diff driver.  This has
+/// to come before ReportTrialTimes, which closes the descriptor they share.
+static void ReportResults() {
+  if (ReportResultsFd >= 0)
+    WriteFully(ReportResultsFd, ResultReport.data(), ResultReport.size());
+}
+
+namespace {
+/// DiffBackend - A configuration -diff runs programs under.
+struct DiffBackend {
+  std::string Name;
+  std::vector<std::string> Args;
+  uint64_t Ulps;
+};
+
+/// DiffOutcome - What one backend made of one program.
+struct DiffOutcome {
+  bool Ran;
+  std::vector<uint64_t> Results;
+  uint64_t CompileNs, RunNs;
+};
+} // end anonymous namespace
+
+/// ParseDiffBackend - Parse "name[@ulps]=flags".
+static bool ParseDiffBackend(const std::string &Spec, DiffBackend &B) {
+  size_t Eq = Spec.find('=');
+  if (Eq == std::string::npos || Eq == 0)
+    return false;
+  B.Name = Spec.substr(0, Eq);
+  B.Ulps = 0;
+  size_t At = B.Name.find('@');
+  if (At != std::string::npos) {
+    B.Ulps = strtoull(B.Name.c_str() + At + 1, 0, 10);
+    B.Name.erase(At);
+  }
+  B.Args.clear();
+  std::string Flags = Spec.substr(Eq + 1);
+  size_t Pos = 0;
+  while (Pos < Flags.size()) {
+    size_t Space = Flags.find(' ', Pos);
+    if (Space == std::string::npos)
+      Space = Flags.size();
+    if (Space != Pos)
+      B.Args.push_back(Flags.substr(Pos, Space - Pos));
+    Pos = Space + 1;
+  }
+  return true;
+}
+
+/// DiffBackendSpecs - -diff-backend, or the built-in set: the least
+/// optimized configuration first as the reference, then every optimizing
+/// path this driver has.  With -diff-rows-input, the built-in set is the
+/// compiled row loop followed by the interpreted and sharded evaluators.
+static std::vector<std::string> DiffBackendSpecs() {
+  if (!DiffBackends.empty())
+    return std::vector<std::string>(DiffBackends.begin(), DiffBackends.end());
+  if (!DiffRowsInput.empty()) {
+    static const char *const Rows[] = {
+      "rows-jit=",
+      "rows-interp=-rows-interp",
+      "rows-shards=-rows-shards=2",
+      "rows-interp-shards=-rows-interp -rows-shards=2",
+    };
+    return std::vector<std::string>(Rows, Rows + array_lengthof(Rows));
+  }
+  static const char *const Builtin[] = {
+    "jit-O0=-codegen-opt=0 -pipeline=mem2reg",
+    "jit-O2=",
+    "jit-O3=-codegen-opt=3",
+    "loop-opts=-loop-opts",
+    "adaptive=-adaptive-opt",
+    "batch=-batch",
+    "async=-async-compile",
+  };
+  return std::vector<std::string>(Builtin,
+                                  Builtin + sizeof(Builtin) / sizeof(*Builtin));
+}
+
+/// ReadRowResults - Append the results -rows wrote to Path to Results.
+static bool ReadRowResults(const std::string &Path,
+                           std::vector<uint64_t> &Results) {
+  FILE *F = fopen(Path.c_str(), "rb");
+  if (!F)
+    return false;
+  if (RowsBinary) {
+    uint64_t Bits;
+    while (fread(&Bits, sizeof(Bits), 1, F) == 1)
+      Results.push_back(Bits);
+  } else {
+    char Line[64];
+    while (fgets(Line, sizeof(Line), F))
+      Results.push_back(DoubleToBits(strtod(Line, 0)));
+  }
+  fclose(F);
+  return true;
+}
+
+/// RunDiffBackend - Run Program under B, keeping the fastest of -diff-runs.
+/// With -diff-rows-input, the -rows results follow the top-level ones.
+static DiffOutcome RunDiffBackend(const DiffBackend &B,
+                                  const std::string &Program) {
+  std::vector<std::string> Args(B.Args);
+  char RowsOut[] = "/tmp/toy-diff-rows-XXXXXX";
+  if (!DiffRowsInput.empty()) {
+    int FD = mkstemp(RowsOut);
+    if (FD < 0) {
+      perror("diff");
+      return DiffOutcome();
+    }
+    close(FD);
+    Args.push_back("-rows=" + RowsFn);
+    Args.push_back("-rows-input=" + DiffRowsInput);
+    Args.push_back(std::string("-rows-output=") + RowsOut);
+    if (RowsBinary)
+      Args.push_back("-rows-binary");
+  }
+  Args.push_back("-report-results-fd=3");
+  Args.push_back("-report-times-fd=3");
+  Args.push_back(Program);
+
+  DiffOutcome O;
+  O.Ran = false;
+  O.CompileNs = O.RunNs = 0;
+  for (unsigned r = 0; r != std::max(1U, (unsigned)DiffRuns); ++r) {
+    std::string Report;
+    if (!RunSelf(Args, DiffTimeout, Report)) {
+      O = DiffOutcome();
+      break;
+    }
+    std::vector<uint64_t> Results;
+    unsigned long long C = 0, R = 0;
+    bool Timed = false;
+    size_t Pos = 0;
+    while (Pos < Report.size()) {
+      size_t End = Report.find('\n', Pos);
+      if (End == std::string::npos)
+        End = Report.size();
+      std::string Line = Report.substr(Pos, End - Pos);
+      unsigned long long Bits;
+      if (sscanf(Line.c_str(), "result %llx", &Bits) == 1)
+        Results.push_back(Bits);
+      else if (sscanf(Line.c_str(), "%llu %llu", &C, &R) == 2)
+        Timed = true;
+      Pos = End + 1;
+    }
+    if (!Timed ||
+        (!DiffRowsInput.empty() && !ReadRowResults(RowsOut, Results))) {
+      O = DiffOutcome();
+      break;
+    }
+    if (!O.Ran || C + R < O.CompileNs + O.RunNs) {
+      O.CompileNs = C;
+      O.RunNs = R;
+    }
+    O.Ran = true;
+    O.Results = Results;
+  }
+  if (!DiffRowsInput.empty())
+    unlink(RowsOut);
+  return O;
+}
+
+/// UlpDistance - How many representable doubles apart A and B are.  Two NaNs
+/// are equal; a NaN and a number are as far apart as possible.
+static uint64_t UlpDistance(uint64_t A, uint64_t B) {
+  double DA = BitsToDouble(A), DB = BitsToDouble(B);
+  if (std::isnan(DA) || std::isnan(DB))
+    return std::isnan(DA) && std::isnan(DB) ? 0 : ~0ULL;
+  // Map the sign-magnitude encoding onto a line of integers.
+  int64_t IA = (int64_t)A, IB = (int64_t)B;
+  if (IA < 0)
+    IA = std::numeric_limits<int64_t>::min() - IA;
+  if (IB < 0)
+    IB = std::numeric_limits<int64_t>::min() - IB;
+  return IA > IB ? (uint64_t)IA - (uint64_t)IB : (uint64_t)IB - (uint64_t)IA;
+}
+
+/// ResultsAgree - Whether a backend allowing Ulps of error may return A where
+/// the reference returned B.  With no tolerance the bits must be identical,
+/// so +0.0 and -0.0, or NaNs with different payloads, still disagree.
+static bool ResultsAgree(uint64_t A, uint64_t B, uint64_t Ulps) {
+  if (Ulps == 0)
+    return A == B;
+  return UlpDistance(A, B) <= Ulps;
+}
+
+/// PrintDifferences - Explain how O disagrees with the reference.
+static void PrintDifferences(const DiffBackend &B, const DiffOutcome &O,
+                            const DiffOutcome &Ref, const char *RefName) {
+  if (O.Results.size() != Ref.Results.size()) {
+    fprintf(stderr, "    %s produced %u results, %s %u\n",
+            B.Name.c_str(), (unsigned)O.Results.size(), RefName,
+            (unsigned)Ref.Results.size());
+    return;
+  }
+  const unsigned MaxShown = 5;
+  unsigned Mismatches = 0;
+  for (unsigned i = 0, e = O.Results.size(); i != e; ++i) {
+    if (ResultsAgree(O.Results[i], Ref.Results[i], B.Ulps))
+      continue;
+    if (Mismatches++ < MaxShown)
+      fprintf(stderr, "    %s: result %u is %.17g (%016llx), %s has "
+                      "%.17g (%016llx)\n", B.Name.c_str(), i,
+              BitsToDouble(O.Results[i]), (unsigned long long)O.Results[i],
+              RefName, BitsToDouble(Ref.Results[i]),
+              (unsigned long long)Ref.Results[i]);
+  }
+  if (Mismatches > MaxShown)
+    fprintf(stderr, "    %s: %u more differences\n", B.Name.c_str(),
+            Mismatches - MaxShown);
+}
+
+/// RunDiff - Run -diff over Programs.  Returns the process exit code: 1 if
+/// any backend failed or disagreed with the reference.
+static int RunDiff(const std::vector<std::string> &Programs) {
+  if (Programs.empty()) {
+    fprintf(stderr, "-diff needs programs as input files\n");
+    return 1;
+  }
+  if (DiffRowsInput.empty() != RowsFn.empty()) {
+    fprintf(stderr, "-diff-rows-input and -rows go together\n");
+    return 1;
+  }
+  std::vector<std::string> Specs = DiffBackendSpecs();
+  std::vector<DiffBackend> Backends(Specs.size());
+  for (unsigned i = 0, e = Specs.size(); i != e; ++i)
+    if (!ParseDiffBackend(Specs[i], Backends[i])) {
+      fprintf(stderr, "-diff-backend: expected name[@ulps]=flags, got '%s'\n",
+              Specs[i].c_str());
+      return 1;
+    }
+
+  bool AllAgree = true;
+  for (unsigned p = 0, pe = Programs.size(); p != pe; ++p) {
+    fprintf(stderr, "%s:\n", Programs[p].c_str());
+    fprintf(stderr, "  %-16s %12s %12s  %s\n", "backend", "compile (ms)",
+            "run (ms)", "results");
+    DiffOutcome Ref;
+    for (unsigned b = 0, be = Backends.size(); b != be; ++b) {
+      const DiffBackend &B = Backends[b];
+      DiffOutcome O = RunDiffBackend(B, Programs[p]);
+      if (b == 0)
+        Ref = O;
+      if (!O.Ran) {
+        fprintf(stderr, "  %-16s %12s %12s  FAILED\n", B.Name.c_str(), "-",
+                "-");
+        AllAgree = false;
+        continue;
+      }
+      const char *Status = "reference";
+      bool Agrees = true;
+      if (b != 0) {
+        // Print the row first; PrintDifferences explains it below.
+        Agrees = Ref.Ran && O.Results.size() == Ref.Results.size();
+        for (unsigned i = 0, e = O.Results.size(); Agrees && i != e; ++i)
+          Agrees = ResultsAgree(O.Results[i], Ref.Results[i], B.Ulps);
+        Status = !Ref.Ran ? "no reference" : Agrees ? "match" : "MISMATCH";
+      }
+      fprintf(stderr, "  %-16s %12.3f %12.3f  %s (%u)\n", B.Name.c_str(),
+              O.CompileNs / 1e6, O.RunNs / 1e6, Status,
+              (unsigned)O.Results.size());
+      if (b != 0 && Ref.Ran && !Agrees) {
+        PrintDifferences(B, O, Ref, Backends[0].Name.c_str());
+        AllAgree = false;
+      }
+    }
+  }
+  return AllAgree ? 0 : 1;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+RowsInterp("rows-interp",
+           cl::desc("Evaluate the -rows function with the batch interpreter "
+                    "instead of compiling it to machine code"));
+
+static cl::list<std::string>
+InputFilenames(cl::Positional, cl::value_desc("file"),
+               cl::desc("<source files> (default: read source from stdin)"));
+
+/// StartRows - Set up the -rows function once all source has been read, then
+/// stream the row input through it.
+static bool StartRows() {
+  Function *F = LookupFunction(RowsFn);
+  if (!F) {
+    fprintf(stderr, "Error: -rows function '%s' is not defined\n",
+            RowsFn.c_str());
+    return false;
+  }
+  FunctionType *FT = F->getFunctionType();
+  bool AllDoubles = FT->getReturnType()->isDoubleTy();
+  for (unsigned i = 0, e = FT->getNumParams(); i != e; ++i)
+    AllDoubles &= FT->getParamType(i)->isDoubleTy();
+  if (!AllDoubles || F->arg_size() == 0) {
+    fprintf(stderr, "Error: -rows needs a function of one or more doubles\n");
+    return false;
+  }
+
+  unsigned Arity = F->arg_size();
+  if (RowsInterp) {
+    std::map<std::string, FunctionAST*>::const_iterator I =
+      Definitions.find(RowsFn);
+    if (I != Definitions.end() && isBatchableDef(I->second)) {
+      // Setup expressions still run, but nothing is optimized or compiled
+      // up front.
+      for (unsigned i = 0, e = PendingExprs.size(); i != e; ++i)
+        EvaluateTopLevel(cast<Function>(PendingExprs[i]));
+      PendingExprs.clear();
+      InterpRowsFn = I->second;
+      if (RowsShards)
+        return RunShardedRows(InterpRowBatch, Arity);
+      return RunRows(InterpRowBatch, Arity);
+    }
+    fprintf(stderr, "Warning: '%s' can't be interpreted in batches; "
+                    "compiling it instead\n", RowsFn.c_str());
+  }
+
+  // Build the row loop before optimizing so that F is inlined into it, and
+  // run any top-level expressions first, since they may set things up.
+  Function *Batch = CreateRowBatchFunction(F);
+  RunBatch();
+  RowBatchFn Fn =
+    (RowBatchFn)(intptr_t)TheExecutionEngine->getPointerToFunction(Batch);
+  if (RowsShards)
+    return RunShardedRows(Fn, Arity);
+  return RunRows(Fn, Arity);
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+  InitMetrics();
+
+  // Compiling to an object or streaming rows reads the whole program first,
+  // just like batch mode.
+  if (!EmitObj.empty() || !RowsFn.empty())
+    BatchMode = true;
+
+  // Instrumented code calls into this process's runtime.
+  if (Instrument && !EmitObj.empty()) {
+    fprintf(stderr, "-instrument can't be used with -emit-obj\n");
+    return 1;
+  }
+
+  // Server workers evaluate requests as they arrive, so the prelude is read
+  // the same way.
+  if (!ServeSocket.empty() && (BatchMode || ServeWorkers == 0)) {
+    fprintf(stderr, "-serve needs at least one worker and can't be combined "
+                    "with -batch, -emit-obj or -rows\n");
+    return 1;
+  }
+
+  if (!InitPipelineSettings())
+    return 1;
+
+  // The autotuner only runs copies of this program; it doesn't compile
+  // anything itself.
+  if (!AutotuneOut.empty())
+    return RunAutotune(std::vector<std::string>(InputFilenames.begin(),
+                                                InputFilenames.end()));
+  if (!ReplayFile.empty())
+    return RunReplay();
+  if (Diff)
+    return RunDiff(std::vector<std::string>(InputFilenames.begin(),
+                                            InputFilenames.end()));
+
+  // The compile queue reads the input itself, after the JIT is set up.
+  if (AsyncCompile && (BatchMode || !ServeSocket.empty() ||
+                       !RecordFile.empty())) {
+    fprintf(stderr, "-async-compile can't be combined with -batch, "
+                    "-emit-obj, -rows, -serve or -record\n");
+    return 1;
+  }
+
+  // Server requests don't come through the main input stream.
+  if (!RecordFile.empty() && !ServeSocket.empty()) {
+    fprintf(stderr, "-record can't be used with -serve\n");
+    return 1;
+  }
+  if (!InitRecording(argc, argv))
+    return 1;
+
+  // Read source from the files named on the command line, if any.
+  for (unsigned i = 0, e = InputFilenames.size(); i != e; ++i) {
+    FILE *F = fopen(InputFilenames[i].c_str(), "r");
+    if (!F) {
+      fprintf(stderr, "Could not open %s\n", InputFilenames[i].c_str());
+      return 1;
+    }
+    if (i == 0)
+      InputFile = F;
+    else
+      PendingInputs.push_back(F);
+  }
+  if (!RowsFn.empty() && RowsInput == "-" && InputFilenames.empty()) {
+    fprintf(stderr, "-rows reads rows from stdin; pass the program as a "
+                    "file\n");
+    return 1;
+  }
+
+  LLVMInitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  LLVMContext &Context = getGlobalContext();
+
+  // Install standard binary operators.
+  // 1 is lowest precedence.
+  BinopPrecedence['='] = 2;
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['*'] = 40;  // highest.
+
+  // Prime the first token.
+  if (!AsyncCompile) {
+    fprintf(stderr, "ready> ");
+    getNextToken();
+  }
 
   // Make the module, which holds all the code.
   TheModule = new Module("my cool jit", Context);
 
   // Create the JIT.  This takes ownership of the module.
   std::string ErrStr;
-  TheExecutionEngine = EngineBuilder(TheModule).setErrorStr(&ErrStr).create();
+  if (CodegenOptLevel > 3) {
+    fprintf(stderr, "-codegen-opt must be between 0 and 3\n");
+    exit(1);
+  }
+  // Keep frame pointers in JIT'd code so the profiler can walk its stack.
+  TargetOptions JITOptions;
+  JITOptions.NoFramePointerElim = true;
+  TheExecutionEngine = EngineBuilder(TheModule)
+                         .setErrorStr(&ErrStr)
+                         .setTargetOptions(JITOptions)
+                         .setOptLevel((CodeGenOpt::Level)(unsigned)CodegenOptLevel)
+                         .create();
   if (!TheExecutionEngine) {
     fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
     exit(1);
   }
 
-  FunctionPassManager OurFPM(TheModule);
+  TheExecutionEngine->RegisterJITEventListener(&TheProfileListener);
+  InitProfiler();
 
-  // Set up the optimizer pipeline.  Start with registering info about how the
-  // target lays out data structures.
+  // Point JIT'd code at the array table and map the requested files.
+  InitMappedArrays();
+  TheExecutionEngine->addGlobalMapping(GetMappedArrayTable(),
+                                       toy_mapped_arrays);
+  for (unsigned i = 0, e = MapArrays.size(); i != e; ++i) {
+    int Handle = toy_map_array(MapArrays[i].c_str());
+    if (Handle < 0) {
+      fprintf(stderr, "Could not map %s\n", MapArrays[i].c_str());
+      exit(1);
+    }
+    fprintf(stderr, "Mapped %s as array %d (%llu doubles)\n",
+            MapArrays[i].c_str(), Handle,
+            (unsigned long long)toy_mapped_arrays[Handle].Length);
+  }
+
+  if (!CodeCacheDir.empty() && !InitCodeCache())
+    fprintf(stderr, "Warning: running without the code cache\n");
+
+  // Set up the optimizer pipelines.
   TheModule->setDataLayout(TheExecutionEngine->getDataLayout());
-  OurFPM.add(new DataLayoutPass(TheModule));
-  //OurFPM.add(new DataLayout(TheModule));
-  // Provide basic AliasAnalysis support for GVN.
-  OurFPM.add(createBasicAliasAnalysisPass());
-  // Promote allocas to registers.
-  OurFPM.add(createPromoteMemoryToRegisterPass());
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  OurFPM.add(createInstructionCombiningPass());
-  // Reassociate expressions.
-  OurFPM.add(createReassociatePass());
-  // Eliminate Common SubExpressions.
-  OurFPM.add(createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  OurFPM.add(createCFGSimplificationPass());
 
-  OurFPM.doInitialization();
+  // The vectorizer needs the target's cost model, so keep the target machine
+  // alive for as long as the pass managers.
+  std::unique_ptr<TargetMachine> LoopTM;
+  if (LoopOpts || AdaptiveOpt || !ActivePipeline.Steps.empty())
+    LoopTM.reset(CreateTargetMachine());
+
+  FunctionPassManager OurFPM(TheModule);
+  AddOptPipeline(OurFPM, tier_full, LoopTM.get());
+  FunctionPassManager LightFPM(TheModule), AggressiveFPM(TheModule);
+  if (AdaptiveOpt) {
+    AddOptPipeline(LightFPM, tier_light, LoopTM.get());
+    AddOptPipeline(AggressiveFPM, tier_aggressive, LoopTM.get());
+  }
+
+  // Set the globals so the code gen can use these.
+  TierPipelines[tier_full] = &OurFPM;
+  if (AdaptiveOpt) {
+    TierPipelines[tier_light] = &LightFPM;
+    TierPipelines[tier_aggressive] = &AggressiveFPM;
+  }
 
-  // Set the global so the code gen can use this.
-  TheFPM = &OurFPM;
+  if (!InitRemarks() || !StartMetricsExporter())
+    return 1;
 
   // Run the main "interpreter loop" now.
-  MainLoop();
+  uint64_t StartNs = MetricNow();
+  if (AsyncCompile)
+    RunAsyncCompile();
+  else
+    MainLoop();
+
+  if (!EmitObj.empty()) {
+    if (!CompileToObject(EmitObj))
+      return 1;
+  } else if (!RowsFn.empty()) {
+    if (!StartRows())
+      return 1;
+  } else if (!ServeSocket.empty()) {
+    if (!RunServer())
+      return 1;
+  } else if (BatchMode) {
+    RunBatch();
+  }
+  ReportResults();
+  ReportTrialTimes(StartNs);
+  ReportItemTimes();
 
-  TheFPM = 0;
+  for (unsigned i = 0; i != NumOptTiers; ++i)
+    TierPipelines[i] = 0;
 
   // Print out all of the generated code.
   TheModule->dump();
 
+  if (Instrument)
+    ReportInstrumentation();
+  ReportPassStats();
+  FinishProfile();
+  FinishPerfCounters();
+  FinishRemarks();
+  FinishRecording();
+  FinishMetrics();
   return 0;
 }